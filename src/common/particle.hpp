@@ -214,11 +214,14 @@ void render(SDL_Window* window, const opengl_buffer<Eigen::Vector3<float>>& x)
     glDisableClientState(GL_VERTEX_ARRAY);
 }
 
+// Renders the positions in the OpenGL buffer x_gl_id. Points with |z| > depth are clipped.
 void render(SDL_Window* window,
-            const opengl_buffer<Eigen::Vector3<float>>& x,
-            const opengl_buffer<Eigen::Vector4<float>>* color)
+            goopax::goopax_device device,
+            unsigned int x_gl_id,
+            size_t size,
+            const opengl_buffer<Eigen::Vector4<float>>* color,
+            double depth = 1)
 {
-    goopax::goopax_device device = x.get_device();
 
     goopax::flush_graphics_interop(device);
     int width, height;
@@ -246,15 +249,15 @@ void render(SDL_Window* window,
     glLoadIdentity();
     Tdouble ar = Tdouble(width) / height;
     Tdouble scale = 0.7;
-    glOrtho(-scale * ar, scale * ar, -scale, scale, -1, 1);
+    glOrtho(-scale * ar, scale * ar, -scale, scale, -depth, depth);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
-    glBindBuffer(GL_ARRAY_BUFFER, x.gl_id);
+    glBindBuffer(GL_ARRAY_BUFFER, x_gl_id);
     glVertexPointer(3, GL_FLOAT, 0, nullptr);
 
     glEnableClientState(GL_VERTEX_ARRAY);
-    glDrawArrays(GL_POINTS, 0, x.size());
+    glDrawArrays(GL_POINTS, 0, size);
     glDisableClientState(GL_VERTEX_ARRAY);
     if (color)
     {
@@ -262,4 +265,11 @@ void render(SDL_Window* window,
     }
 }
 
+void render(SDL_Window* window,
+            const opengl_buffer<Eigen::Vector3<float>>& x,
+            const opengl_buffer<Eigen::Vector4<float>>* color)
+{
+    render(window, x.get_device(), x.gl_id, x.size(), color);
+}
+
 #endif
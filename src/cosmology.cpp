@@ -7,15 +7,14 @@
    but with some modifications:
    - Multipoles are represented in Cartesian coordinates instead of the usual spherical harmonics.
    - A binary tree is used instead of an octree.
+   - Optionally, the long-range part of the forces is calculated on a mesh (TreePM, --pm_grid).
 
    The parameters are optimise for big GPUs with many registers.
    If you want to run it on smaller GPUs with <256 registers,
-   you might want to reduce MULTIPOLE_ORDER to 2 or so. The precision will be worse,
+   you might want to reduce the multipole order to 2 or so (--multipole_order=2). The precision will be worse,
    but at least it will run with usable performance.
  */
 
-#define WITH_TIMINGS 0
-
 #if __has_include(<opencv2/opencv.hpp>)
 #include <opencv2/opencv.hpp>
 #define WITH_OPENCV 1
@@ -25,13 +24,14 @@
 
 #include "common/particle.hpp"
 #include <SDL3/SDL_main.h>
-#if WITH_TIMINGS
+#include <bit>
 #include <chrono>
-#endif
 #include <fstream>
 #include <goopax_draw/window_sdl.h>
 #include <goopax_extra/output.hpp>
 #include <goopax_extra/param.hpp>
+#include <goopax_extra/random.hpp>
+#include <iomanip>
 #include <random>
 #include <set>
 
@@ -85,7 +85,23 @@ ostream& operator<<(ostream& s, const pair<A, B>& p)
 }
 }
 
+/*
+  Signature width, 64 or 128. Set with -DSIGNATURE_BITS=128 or the CMake variable COSMOLOGY_SIGNATURE_BITS.
+  With 128, max_depth can exceed 64 for deep zoom simulations. The positions stay in single precision, which caps
+  max_depth at 72 (with the default ls_use and max_bignode_bits, see the check in cosmos_base). At that depth, the
+  cells in the outer half of the box are only about two float spacings of the positions wide, so deeper levels would
+  hardly separate any particles there.
+ */
+#ifndef SIGNATURE_BITS
+#define SIGNATURE_BITS 64
+#endif
+
+#if SIGNATURE_BITS == 128
+#include "uint128_signature.hpp"
+using signature_t = uint128_signature<Tuint64_t>;
+#else
 using signature_t = Tuint64_t;
+#endif
 using gpu_signature_t = typename make_gpu<signature_t>::type;
 
 using CTuint = Tuint;
@@ -110,29 +126,105 @@ Tuint log2_exact(Tsize_t a)
     abort();
 }
 
+#include "phase_timer.hpp"
 #include "radix_sort.hpp"
+#include "incremental_sort.hpp"
+#include "tree_grid.hpp"
+#include "halo_finder.hpp"
+#include "neighbor_search.hpp"
+#include "essential_tree.hpp"
+#include "particle_mesh.hpp"
+#include "snapshot.hpp"
+#include "tunable.hpp"
 const float halflen = 4;
-PARAMOPT<Tfloat> MULTIPOLE_COSTFAC("multipole_costfac", 160);
-PARAMOPT<Tuint> MAX_BIGNODE_BITS("max_bignode_bits", 3);
-PARAMOPT<Tuint> MAX_NODESIZE("max_nodesize", 16);
+tunable<Tfloat> MULTIPOLE_COSTFAC("multipole_costfac", 160);
+tunable<Tuint> MAX_BIGNODE_BITS("max_bignode_bits", 3);
+tunable<Tuint> MAX_NODESIZE("max_nodesize", 16);
+tunable<Tuint> LS_USE("ls_use", 64); // Local size of the downwards kernel. Must be a power of 4.
 PARAMOPT<Tuint> MAX_DEPTH("max_depth", 64);
+PARAMOPT<Tdouble> TREE_GROWTH("tree_growth", 1.5); // Growth factor when the tree buffer overflows
+PARAMOPT<Tuint> TREE_LEVELS_PER_SYNC("tree_levels_per_sync", 4); // Tree levels built between host synchronizations
 PARAMOPT<Tbool> POW2_SIZEVEC("pow2_sizevec", true);
+PARAMOPT<bool> INCREMENTAL_SORT("incremental_sort", true); // Re-sort only the particles that changed their cell
+PARAMOPT<Tdouble> INCREMENTAL_SORT_MAX_FRACTION("incremental_sort_max_fraction", 0.05); // Otherwise full sort
+PARAMOPT<Tuint> SORT_DEPTH_MARGIN("sort_depth_margin", 0); // Sort the signature bits only down to the previous tree
+                                                           // depth plus this many levels, e.g. 12. 0=all bits
+PARAMOPT<Tuint> REFIT_INTERVAL("refit_interval", 1); // Rebuild the tree every K force calculations, refit in between
+PARAMOPT<Tdouble> REFIT_MAX_DRIFT("refit_max_drift", 0.5); // Rebuild earlier if particles moved by more than this
+                                                            // fraction of the smallest cell size
 #define CALC_POTENTIAL 1
+#define TRACELESS_MULTIPOLES 1 // Store only the independent components of the multipoles in the tree nodes
 
 PARAMOPT<string> IC("ic", "");
 
 PARAMOPT<Tsize_t> NUM_PARTICLES("num_particles", 1000000); // Number of particles
+PARAMOPT<Tdouble> MEMORY_BUDGET("memory_budget", 0); // If set, use as many particles as fit into this many MB
+PARAMOPT<bool> LEAN_MEMORY("lean_memory", false);    // Permute the particle arrays one at a time, with less scratch
 PARAMOPT<Tdouble> DT("dt", 5E-3);
-PARAMOPT<Tdouble> MAX_DISTFAC("max_distfac", 1.2);
+tunable<Tdouble> MAX_DISTFAC("max_distfac", 1.2);
+PARAMOPT<Tuint> PM_GRID("pm_grid", 0);      // TreePM: mesh cells along the shortest box dimension. 0=tree only
+PARAMOPT<Tdouble> PM_SPLIT("pm_split", 1.25); // TreePM: split radius r_s in mesh cells
+PARAMOPT<Tdouble> PM_CUTOFF("pm_cutoff", 4.5); // TreePM: no short-range forces beyond this many r_s
+PARAMOPT<Tuint> MAX_TIMEBIN("max_timebin", 0); // Block time steps down to dt/2^max_timebin. 0=global time step
+PARAMOPT<Tdouble> TIMESTEP_ETA("timestep_eta", 0.025);
+PARAMOPT<Tdouble> TIMESTEP_SOFTENING("timestep_softening", 1E-3);
 
 PARAMOPT<bool> PRECISION_TEST("precision_test", false);
-
-constexpr unsigned int MULTIPOLE_ORDER = 4;
+PARAMOPT<bool> PRECISION_TEST_FLOAT("precision_test_float", false); // Reference pair terms in T, for devices without
+                                                                    // double precision
+PARAMOPT<Tuint> PRECISION_SAMPLES("precision_samples", 4096); // Number of particles compared to direct summation
+PARAMOPT<bool> NEIGHBOR_TEST("neighbor_test", false);         // Check the neighbor queries against brute force
+
+PARAMOPT<bool> HEADLESS("headless", false);                   // Run without window and renderer
+PARAMOPT<Tuint> STEPS_PER_FRAME("steps_per_frame", 1);        // Simulation steps per displayed frame
+PARAMOPT<Tdouble> MAX_FPS("max_fps", 60);                     // Frames are skipped if rendering would exceed this rate
+// Headless: distribute the force calculation over this many devices. The first device still holds all particles
+// and the full tree, so this speeds up the forces but does not raise the particle limit of one device.
+PARAMOPT<Tuint> NUM_DEVICES("num_devices", 1);
+PARAMOPT<Tuint> NUM_STEPS("num_steps", 100);                  // Number of steps in headless mode
+PARAMOPT<Tuint> SNAPSHOT_INTERVAL("snapshot_interval", 0);    // Write a snapshot every K steps, 0=never
+PARAMOPT<string> SNAPSHOT_PREFIX("snapshot_prefix", "snapshot");
+PARAMOPT<string> RESTART("restart", "");                      // Restart from this snapshot file
+PARAMOPT<Tuint> FOF_INTERVAL("fof_interval", 0);              // Headless: find halos every K steps, 0=never
+PARAMOPT<Tdouble> FOF_LINKING_LENGTH("fof_linking_length", 0.2); // In units of the mean particle spacing in the box
+PARAMOPT<Tuint> FOF_MIN_MEMBERS("fof_min_members", 20);       // Smallest group that is written to the catalogue
+PARAMOPT<string> FOF_PREFIX("fof_prefix", "halos");
+PARAMOPT<string> TIMINGS("timings", "");                      // Write per-phase timings to this file
+PARAMOPT<bool> TIMINGS_CHROME("timings_chrome", false);       // Chrome trace format instead of JSON lines
+
+tunable<Tuint> MULTIPOLE_ORDER("multipole_order", 4); // 1...4
+PARAMOPT<string> FMM_CONFIG("fmm_config", "");          // Load tuned parameters from this file
+
+PARAMOPT<bool> TUNE("tune", false);                            // Search for the fastest parameters
+PARAMOPT<Tdouble> TUNE_TARGET_ERROR("tune_target_error", 1E-3); // Maximum relative rms force error
+PARAMOPT<string> TUNE_OUTPUT("tune_output", "fmm_config.txt");
+PARAMOPT<Tuint> TUNE_ROUNDS("tune_rounds", 3);
 
 using GPU_DOUBLE = gpu_double;
 using TDOUBLE = Tdouble;
 using CTDOUBLE = Tdouble;
 
+// Storage type of the multipole components C, D and E in the tree nodes: Tfloat, Thalf or Tbfloat16.
+// A and B, as well as all arithmetic, stay in full precision. Requires TRACELESS_MULTIPOLES.
+// With Thalf or Tbfloat16, the components are normalized by the node mass and size before packing, see
+// traceless_multipole. Set with -DMULTIPOLE_HIGH_TYPE=Thalf or the CMake variable COSMOLOGY_MULTIPOLE_TYPE.
+#ifndef MULTIPOLE_HIGH_TYPE
+#define MULTIPOLE_HIGH_TYPE Tfloat
+#endif
+using TMULTIPOLE_HIGH = MULTIPOLE_HIGH_TYPE;
+
+template<class U>
+const char* type_name()
+{
+    if (std::is_same<U, Thalf>::value)
+        return "half";
+    if (std::is_same<U, Tbfloat16>::value)
+        return "bfloat16";
+    if (std::is_same<U, Tdouble>::value)
+        return "double";
+    return "float";
+}
+
 template<class T>
 Vector<T, 4> color(T pot)
 {
@@ -194,6 +286,67 @@ const auto MI2 = reinterpret<Vector<Vector<Tuint, 3>, 3>>(make_mi<2>());
 const auto MI3 = reinterpret<Vector<Vector<Vector<Tuint, 3>, 3>, 3>>(make_mi<3>());
 const auto MI4 = reinterpret<Vector<Vector<Vector<Vector<Tuint, 3>, 3>, 3>, 3>>(make_mi<4>());
 
+/*
+  The tensors C, D and E of a multipole are symmetric and traceless. This holds for the multipole expansions, and for
+  local expansions of a harmonic potential. The short-range potential of TreePM is not harmonic, so the local
+  expansions of the downwards pass are kept in full (see add_local).
+  A traceless symmetric tensor of rank r has 2r+1 independent components. The components with at most one z index
+  are stored, the others follow from the vanishing traces: T[..zz] = -(T[..xx] + T[..yy]). The operators M2M, M2L
+  and L2L of multipole only evaluate the independent components of traceless results, see fill_traces.
+ */
+template<unsigned int R>
+struct traceless_layout
+{
+    vector<Tuint> stored;            // Positions of the stored components in the full symmetric storage.
+    vector<array<Tuint, 3>> derived; // {position, xx source, yy source}, in the order of evaluation.
+
+    traceless_layout()
+    {
+        const vector<Tuint> mi = make_mi<R>();
+        auto pos = [&](vector<Tuint> idx) {
+            sort(idx.begin(), idx.end());
+            Tuint flat = 0;
+            for (Tuint i : idx)
+                flat = flat * 3 + i;
+            return mi[flat];
+        };
+
+        // Sorted index tuples, ordered by the number of z indices, so that the sources are always known.
+        vector<pair<Tuint, vector<Tuint>>> components;
+        for (const vector<Tuint>& idx : make_indices<R>())
+        {
+            if (std::is_sorted(idx.begin(), idx.end()))
+            {
+                components.push_back({ Tuint(std::count(idx.begin(), idx.end(), 2u)), idx });
+            }
+        }
+        std::stable_sort(components.begin(), components.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+
+        for (const auto& [num_z, idx] : components)
+        {
+            if (num_z <= 1)
+            {
+                stored.push_back(pos(idx));
+            }
+            else
+            {
+                vector<Tuint> xx(idx.begin(), idx.end() - 2);
+                vector<Tuint> yy = xx;
+                xx.insert(xx.end(), { 0, 0 });
+                yy.insert(yy.end(), { 1, 1 });
+                derived.push_back({ pos(idx), pos(xx), pos(yy) });
+            }
+        }
+        assert(stored.size() == 2 * R + 1);
+    }
+};
+
+const traceless_layout<2> TL2;
+const traceless_layout<3> TL3;
+const traceless_layout<4> TL4;
+
 template<class T>
 Vector<T, 3> rot(const Vector<T, 3>& a, Tint step = 1)
 {
@@ -283,6 +436,46 @@ struct multipole
         return *this;
     }
 
+    // Whether the component of C, D or E with the sorted indices (..., second_last, last) is independent in a
+    // traceless tensor, i.e. has at most one z index. See traceless_layout.
+    static constexpr bool independent(Tuint second_last)
+    {
+        return second_last != 2;
+    }
+
+    // Adds the independent components of b. The others are left for fill_traces.
+    multipole& add_independent(const multipole& b)
+    {
+        A += b.A;
+        if (N >= 1)
+            B += b.B;
+        if (N >= 2)
+            for (Tuint k : TL2.stored)
+                C[k] += b.C[k];
+        if (N >= 3)
+            for (Tuint k : TL3.stored)
+                D[k] += b.D[k];
+        if (N >= 4)
+            for (Tuint k : TL4.stored)
+                E[k] += b.E[k];
+        return *this;
+    }
+
+    // Sets the dependent components of C, D and E from the vanishing traces.
+    multipole& fill_traces()
+    {
+        if (N >= 2)
+            for (const auto& d : TL2.derived)
+                C[d[0]] = -(C[d[1]] + C[d[2]]);
+        if (N >= 3)
+            for (const auto& d : TL3.derived)
+                D[d[0]] = -(D[d[1]] + D[d[2]]);
+        if (N >= 4)
+            for (const auto& d : TL4.derived)
+                E[d[0]] = -(E[d[1]] + E[d[2]]);
+        return *this;
+    }
+
     static multipole from_particle(Vector<T, 3> a, T mass, uint_type ID = 0)
     {
         (void)ID;
@@ -343,6 +536,7 @@ struct multipole
         return M;
     }
 
+    // M2M. The multipole is traceless, so only the independent components are evaluated.
     multipole shift_ext(Vector<T, 3> a) const
     {
         multipole M = *this;
@@ -353,7 +547,7 @@ struct multipole
         }
         if (N >= 2)
         {
-            for (Tuint i = 0; i < 3; ++i)
+            for (Tuint i = 0; i < 2; ++i)
                 for (Tuint k = i; k < 3; ++k)
                 {
                     M.C[MI2[i][k]] += 1.5f * a[i] * a[k] * A - 0.5f * A * a.squaredNorm() * Tint(i == k)
@@ -366,8 +560,8 @@ struct multipole
         }
         if (N >= 3)
         {
-            for (Tuint i = 0; i < 3; ++i)
-                for (Tuint k = i; k < 3; ++k)
+            for (Tuint i = 0; i < 2; ++i)
+                for (Tuint k = i; k < 2; ++k)
                     for (Tuint l = k; l < 3; ++l)
                     {
                         M.D[MI3[i][k][l]] += 2.5f * A * a[i] * a[k] * a[l]
@@ -390,9 +584,9 @@ struct multipole
         }
         if (N >= 4)
         {
-            for (Tuint i = 0; i < 3; ++i)
-                for (Tuint k = i; k < 3; ++k)
-                    for (Tuint l = k; l < 3; ++l)
+            for (Tuint i = 0; i < 2; ++i)
+                for (Tuint k = i; k < 2; ++k)
+                    for (Tuint l = k; l < 2; ++l)
                         for (Tuint m = l; m < 3; ++m)
                         {
                             M.E[MI4[i][k][l][m]] +=
@@ -455,10 +649,11 @@ struct multipole
                             }
                         }
         }
-        return M;
+        return M.fill_traces();
     }
 
-    multipole shift_loc(Vector<T, 3> a) const
+    // L2L. If the local expansion is traceless, only the independent components are evaluated.
+    multipole shift_loc(Vector<T, 3> a, bool traceless) const
     {
         a = -a;
         multipole M = *this;
@@ -486,7 +681,7 @@ struct multipole
                     {
                         M.A += D[MI3[i][k][l]] * a[i] * a[k] * a[l];
                         M.B[i] += 3 * D[MI3[i][k][l]] * a[k] * a[l];
-                        if (i <= k)
+                        if (i <= k && (!traceless || independent(i)))
                             M.C[MI2[i][k]] += 3 * D[MI3[i][k][l]] * a[l];
                     }
         }
@@ -499,28 +694,48 @@ struct multipole
                         {
                             M.A += E[MI4[i][k][l][m]] * a[i] * a[k] * a[l] * a[m];
                             M.B[i] += 4 * E[MI4[i][k][l][m]] * a[k] * a[l] * a[m];
-                            if (i <= k)
+                            if (i <= k && (!traceless || independent(i)))
                                 M.C[MI2[i][k]] += 6 * E[MI4[i][k][l][m]] * a[l] * a[m];
-                            if (i <= k && k <= l)
+                            if (i <= k && k <= l && (!traceless || independent(k)))
                                 M.D[MI3[i][k][l]] += 4 * E[MI4[i][k][l][m]] * a[m];
                         }
         }
+        if (traceless)
+        {
+            M.fill_traces();
+        }
         return M;
     }
 
-    multipole makelocal(Vector<T, 3> a) const
+    /*
+      Local expansion of the field of this multipole at distance vector a. If s is given, the kernel is not 1/r but
+      a radial function whose m-th derivative (d / r dr)^m is s[m] times that of 1/r, for m = 0 ... N. A term at
+      derivative order n with j factors of e belongs to m = (n + j) / 2.
+      This multipole must be traceless. Without s, the local expansion is traceless as well, and only its
+      independent components are evaluated.
+     */
+    multipole makelocal(Vector<T, 3> a, const T* s = nullptr) const
     {
+        // Whether the output component with the sorted indices (..., second_last, last) is evaluated.
+        auto out = [s](Tuint second_last) { return s != nullptr || independent(second_last); };
+        auto S = [s](Tuint m, auto x) {
+            if (s != nullptr)
+            {
+                x *= s[m];
+            }
+            return x;
+        };
         a = -a;
         multipole M;
         T inva = pow<-1, 2>(a.squaredNorm());
         Vector<T, 3> e = a * inva;
-        M.A = inva * A;
+        M.A = S(0, inva * A);
         if (N >= 1)
         {
             for (Tuint n = 0; n < 3; ++n)
             {
-                M.B[n] = -pow2(inva) * A * e[n];
-                M.A += pow2(inva) * B[n] * e[n];
+                M.B[n] = S(1, -pow2(inva) * A * e[n]);
+                M.A += S(1, pow2(inva) * B[n] * e[n]);
             }
         }
         if (N >= 2)
@@ -529,13 +744,13 @@ struct multipole
             {
                 for (Tuint k = 0; k < 3; ++k)
                 {
-                    if (i <= k)
-                        M.C[MI2[i][k]] = pow3(inva) * (1.5f * A * e[i] * e[k] - 0.5f * A * Tint(i == k));
-                    M.B[i] += pow3(inva) * (-3 * B[k] * e[k] * e[i]);
-                    M.A += pow3(inva) * C[MI2[i][k]] * e[i] * e[k];
+                    if (i <= k && out(i))
+                        M.C[MI2[i][k]] = pow3(inva) * (S(2, 1.5f * A * e[i] * e[k]) + S(1, -0.5f * A * Tint(i == k)));
+                    M.B[i] += S(2, pow3(inva) * (-3 * B[k] * e[k] * e[i]));
+                    M.A += S(2, pow3(inva) * C[MI2[i][k]] * e[i] * e[k]);
                 }
             }
-            M.B += pow3(inva) * B;
+            M.B += S(1, pow3(inva) * B);
         }
         if (N >= 3)
         {
@@ -545,21 +760,22 @@ struct multipole
                 {
                     for (Tuint l = 0; l < 3; ++l)
                     {
-                        if (i <= k && k <= l)
+                        if (i <= k && k <= l && out(k))
                             M.D[MI3[i][k][l]] =
                                 pow4(inva)
-                                * (-5.0f / 2 * A * e[i] * e[k] * e[l]
-                                   + 0.5f * A * (e[i] * Tint(k == l) + e[k] * Tint(i == l) + e[l] * Tint(i == k)));
-                        if (i <= k)
-                            M.C[MI2[i][k]] +=
-                                pow4(inva)
-                                * (15.0f / 2 * B[l] * e[l] * e[i] * e[k] - 1.5f * B[l] * e[l] * Tint(i == k));
-                        M.B[i] += pow4(inva) * (-5 * C[MI2[k][l]] * e[k] * e[l] * e[i]);
-                        M.A += pow4(inva) * (D[MI3[i][k][l]] * e[i] * e[k] * e[l]);
+                                * (S(3, -5.0f / 2 * A * e[i] * e[k] * e[l])
+                                   + S(2,
+                                       0.5f * A * (e[i] * Tint(k == l) + e[k] * Tint(i == l) + e[l] * Tint(i == k))));
+                        if (i <= k && out(i))
+                            M.C[MI2[i][k]] += pow4(inva)
+                                              * (S(3, 15.0f / 2 * B[l] * e[l] * e[i] * e[k])
+                                                 + S(2, -1.5f * B[l] * e[l] * Tint(i == k)));
+                        M.B[i] += S(3, pow4(inva) * (-5 * C[MI2[k][l]] * e[k] * e[l] * e[i]));
+                        M.A += S(3, pow4(inva) * (D[MI3[i][k][l]] * e[i] * e[k] * e[l]));
                     }
-                    if (i <= k)
-                        M.C[MI2[i][k]] += pow4(inva) * (-1.5f * (B[i] * e[k] + B[k] * e[i]));
-                    M.B[i] += pow4(inva) * 2 * C[MI2[i][k]] * e[k];
+                    if (i <= k && out(i))
+                        M.C[MI2[i][k]] += S(2, pow4(inva) * (-1.5f * (B[i] * e[k] + B[k] * e[i])));
+                    M.B[i] += S(2, pow4(inva) * 2 * C[MI2[i][k]] * e[k]);
                 }
             }
         }
@@ -573,44 +789,52 @@ struct multipole
                     {
                         for (Tuint m = 0; m < 3; ++m)
                         {
-                            if (i <= k && k <= l && l <= m)
+                            if (i <= k && k <= l && l <= m && out(l))
                                 M.E[MI4[i][k][l][m]] =
                                     pow5(inva)
-                                    * (35.0f / 8 * A * e[i] * e[k] * e[l] * e[m]
-                                       + 1.0f / 8 * A
-                                             * (Tint(i == k) * Tint(l == m) + Tint(i == l) * Tint(k == m)
-                                                + Tint(i == m) * Tint(k == l))
-                                       - 5.0f / 8 * A
-                                             * (e[i] * e[k] * Tint(l == m) + e[i] * e[l] * Tint(k == m)
-                                                + e[i] * e[m] * Tint(k == l) + e[k] * e[l] * Tint(i == m)
-                                                + e[k] * e[m] * Tint(i == l) + e[l] * e[m] * Tint(i == k)));
-                            if (i <= k && k <= l)
+                                    * (S(4, 35.0f / 8 * A * e[i] * e[k] * e[l] * e[m])
+                                       + S(2,
+                                           1.0f / 8 * A
+                                               * (Tint(i == k) * Tint(l == m) + Tint(i == l) * Tint(k == m)
+                                                  + Tint(i == m) * Tint(k == l)))
+                                       + S(3,
+                                           -5.0f / 8 * A
+                                               * (e[i] * e[k] * Tint(l == m) + e[i] * e[l] * Tint(k == m)
+                                                  + e[i] * e[m] * Tint(k == l) + e[k] * e[l] * Tint(i == m)
+                                                  + e[k] * e[m] * Tint(i == l) + e[l] * e[m] * Tint(i == k))));
+                            if (i <= k && k <= l && out(k))
                                 M.D[MI3[i][k][l]] +=
                                     pow5(inva)
-                                    * (-35.0f / 2 * B[m] * e[m] * e[i] * e[k] * e[l]
-                                       + 5.0f / 2 * B[m] * e[m]
-                                             * (e[i] * Tint(k == l) + e[k] * Tint(i == l) + e[l] * Tint(i == k)));
-                            if (i <= k)
+                                    * (S(4, -35.0f / 2 * B[m] * e[m] * e[i] * e[k] * e[l])
+                                       + S(3,
+                                           5.0f / 2 * B[m] * e[m]
+                                               * (e[i] * Tint(k == l) + e[k] * Tint(i == l) + e[l] * Tint(i == k))));
+                            if (i <= k && out(i))
                                 M.C[MI2[i][k]] += pow5(inva)
-                                                  * (35.0f / 2 * C[MI2[l][m]] * e[l] * e[m] * e[i] * e[k]
-                                                     - 5.0f / 2 * C[MI2[l][m]] * e[l] * e[m] * Tint(i == k));
-                            M.B[i] += pow5(inva) * (-7 * D[MI3[k][l][m]] * e[k] * e[l] * e[m] * e[i]);
-                            M.A += pow5(inva) * (E[MI4[i][k][l][m]] * e[i] * e[k] * e[l] * e[m]);
+                                                  * (S(4, 35.0f / 2 * C[MI2[l][m]] * e[l] * e[m] * e[i] * e[k])
+                                                     + S(3, -5.0f / 2 * C[MI2[l][m]] * e[l] * e[m] * Tint(i == k)));
+                            M.B[i] += S(4, pow5(inva) * (-7 * D[MI3[k][l][m]] * e[k] * e[l] * e[m] * e[i]));
+                            M.A += S(4, pow5(inva) * (E[MI4[i][k][l][m]] * e[i] * e[k] * e[l] * e[m]));
                         }
-                        if (i <= k && k <= l)
+                        if (i <= k && k <= l && out(k))
                             M.D[MI3[i][k][l]] +=
                                 pow5(inva)
-                                * (+5.0f / 2 * (B[i] * e[k] * e[l] + B[k] * e[i] * e[l] + B[l] * e[i] * e[k])
-                                   - 0.5f * (B[i] * Tint(k == l) + B[k] * Tint(i == l) + B[l] * Tint(i == k)));
-                        if (i <= k)
-                            M.C[MI2[i][k]] += pow5(inva) * (-5 * e[l] * (C[MI2[l][k]] * e[i] + C[MI2[l][i]] * e[k]));
-                        M.B[i] += pow5(inva) * 3 * D[MI3[i][k][l]] * e[k] * e[l];
+                                * (S(3, 5.0f / 2 * (B[i] * e[k] * e[l] + B[k] * e[i] * e[l] + B[l] * e[i] * e[k]))
+                                   + S(2, -0.5f * (B[i] * Tint(k == l) + B[k] * Tint(i == l) + B[l] * Tint(i == k))));
+                        if (i <= k && out(i))
+                            M.C[MI2[i][k]] +=
+                                S(3, pow5(inva) * (-5 * e[l] * (C[MI2[l][k]] * e[i] + C[MI2[l][i]] * e[k])));
+                        M.B[i] += S(3, pow5(inva) * 3 * D[MI3[i][k][l]] * e[k] * e[l]);
                     }
-                    if (i <= k)
-                        M.C[MI2[i][k]] += pow5(inva) * C[MI2[i][k]];
+                    if (i <= k && out(i))
+                        M.C[MI2[i][k]] += S(2, pow5(inva) * C[MI2[i][k]]);
                 }
             }
         }
+        if (s == nullptr)
+        {
+            M.fill_traces();
+        }
         return M;
     }
 
@@ -690,6 +914,157 @@ struct multipole
     }
 };
 
+/*
+  Storage format of a multipole with only the independent components. Arithmetic is done on the unpacked multipole.
+  The components C, D and E are stored in type HIGH, which may have reduced precision.
+  If HIGH is narrower than float, the rank n components are divided by the node mass |A| times h^n before packing
+  and multiplied back after unpacking, where h is the size of the node. This keeps them of order one. Otherwise,
+  half precision would flush the moments of light nodes to zero.
+ */
+template<class T, unsigned int N, class HIGH = TMULTIPOLE_HIGH>
+struct traceless_multipole
+{
+    using goopax_struct_type = T;
+    template<typename X>
+    using goopax_struct_changetype = traceless_multipole<typename goopax_struct_changetype<T, X>::type, N, HIGH>;
+    using high_type = typename change_gpu_mode<HIGH, T>::type;
+
+    T A;
+    Vector<T, 3 * (N >= 1)> B;
+    Vector<high_type, 5 * (N >= 2)> C;
+    Vector<high_type, 7 * (N >= 3)> D;
+    Vector<high_type, 9 * (N >= 4)> E;
+
+    traceless_multipole()
+    {
+    }
+
+    template<class U>
+    traceless_multipole(const traceless_multipole<U, N, HIGH>& b)
+        : A(b.A)
+    {
+        std::copy(b.B.begin(), b.B.end(), B.begin());
+        std::copy(b.C.begin(), b.C.end(), C.begin());
+        std::copy(b.D.begin(), b.D.end(), D.begin());
+        std::copy(b.E.begin(), b.E.end(), E.begin());
+    }
+
+    template<class U>
+    traceless_multipole(const multipole<U, N>& m)
+        : A(m.A)
+    {
+        std::copy(m.B.begin(), m.B.end(), B.begin());
+        pack_tensor(m.C, C, TL2);
+        pack_tensor(m.D, D, TL3);
+        pack_tensor(m.E, E, TL4);
+    }
+
+    // Packs m of a node of size h.
+    traceless_multipole(const multipole<T, N>& m, const T& h)
+        : traceless_multipole(normalize ? scale_ranks(m, cond(m.A != 0, T(-1) / m.A, T(0)), T(1) / h) : m)
+    {
+    }
+
+    multipole<T, N> unpack() const
+    {
+        multipole<T, N> m;
+        m.A = A;
+        std::copy(B.begin(), B.end(), m.B.begin());
+        unpack_tensor(C, m.C, TL2);
+        unpack_tensor(D, m.D, TL3);
+        unpack_tensor(E, m.E, TL4);
+        return m;
+    }
+
+    // Unpacks the multipole of a node of size h.
+    multipole<T, N> unpack(const T& h) const
+    {
+        const multipole<T, N> m = unpack();
+        return normalize ? scale_ranks(m, -m.A, h) : m;
+    }
+
+    operator multipole<T, N>() const
+    {
+        return unpack();
+    }
+
+    static constexpr bool normalize = !std::is_same<HIGH, Tfloat>::value && !std::is_same<HIGH, Tdouble>::value;
+
+    // Multiplies the rank n components by f * g^n, for n >= 2.
+    static multipole<T, N> scale_ranks(multipole<T, N> m, const T& f, const T& g)
+    {
+        T s = f * g * g;
+        m.C *= s;
+        s *= g;
+        m.D *= s;
+        s *= g;
+        m.E *= s;
+        return m;
+    }
+
+    template<class FULL, class PACKED, unsigned int R>
+    static void pack_tensor(const FULL& full, PACKED& packed, const traceless_layout<R>& layout)
+    {
+        for (Tuint k = 0; k < packed.size(); ++k)
+        {
+            packed[k] = static_cast<high_type>(static_cast<T>(full[layout.stored[k]]));
+        }
+    }
+
+    template<class PACKED, class FULL, unsigned int R>
+    static void unpack_tensor(const PACKED& packed, FULL& full, const traceless_layout<R>& layout)
+    {
+        if (packed.size() == 0)
+            return;
+        for (Tuint k = 0; k < packed.size(); ++k)
+        {
+            full[layout.stored[k]] = static_cast<T>(packed[k]);
+        }
+        for (const auto& d : layout.derived)
+        {
+            full[d[0]] = -(full[d[1]] + full[d[2]]);
+        }
+    }
+
+    template<class STREAM>
+    friend STREAM& operator<<(STREAM& s, const traceless_multipole& m)
+    {
+        return s << m.unpack();
+    }
+};
+
+#if TRACELESS_MULTIPOLES
+template<class T, unsigned int N>
+using multipole_storage = traceless_multipole<T, N>;
+
+// Stored multipole of a node of size h, and back.
+template<class T, unsigned int N>
+multipole_storage<T, N> pack_node_multipole(const multipole<T, N>& m, const T& h)
+{
+    return { m, h };
+}
+template<class T, unsigned int N>
+multipole<T, N> unpack_node_multipole(const multipole_storage<T, N>& m, const T& h)
+{
+    return m.unpack(h);
+}
+#else
+static_assert(std::is_same<TMULTIPOLE_HIGH, Tfloat>::value, "TMULTIPOLE_HIGH requires TRACELESS_MULTIPOLES");
+template<class T, unsigned int N>
+using multipole_storage = multipole<T, N>;
+
+template<class T, unsigned int N>
+multipole_storage<T, N> pack_node_multipole(const multipole<T, N>& m, const T&)
+{
+    return m;
+}
+template<class T, unsigned int N>
+multipole<T, N> unpack_node_multipole(const multipole_storage<T, N>& m, const T&)
+{
+    return m;
+}
+#endif
+
 template<class T, unsigned int max_multipole>
 struct treenode
 {
@@ -702,7 +1077,7 @@ struct treenode
     uint_type pbegin;
     uint_type pend;
     // uint_type parent;
-    multipole<T, max_multipole> Mr;
+    multipole_storage<T, max_multipole> Mr;
 
     template<class STREAM>
     friend STREAM& operator<<(STREAM& s, const treenode& n)
@@ -788,17 +1163,66 @@ auto calc_sig_fast(const Vector<T, 3>& x, Tuint64_t)
     return sig;
 }
 
+#if SIGNATURE_BITS == 128
+// Spreads the lowest 22 bits of s to every third bit.
+template<class W>
+W spread_bits3(W s)
+{
+    s = (W(s & 0xffff0000) << 32) | (s & 0x0000ffff);
+    s = ((s & 0xff00ff00ff00ff00) << 16) | (s & 0x00ff00ff00ff00ff);
+    s = ((s & 0xf0f0f0f0f0f0f0f0) << 8) | (s & 0x0f0f0f0f0f0f0f0f);
+    s = ((s & 0xcccccccccccccccc) << 4) | (s & 0x3333333333333333);
+    s = ((s & 0xaaaaaaaaaaaaaaaa) << 2) | (s & 0x5555555555555555);
+    return s;
+}
+
+/*
+  Same bit layout as the 64-bit signature, continued down to 128 bits. Each dimension is converted to a 43-bit integer
+  (42 bits for z) with the sign in the top bit. Level j of dimension k goes to bit 127 - 3 * j - k, so the high word
+  holds the levels 0 ... 21 and the low word the remaining levels.
+ */
+template<class T>
+auto calc_sig_fast(const Vector<T, 3>& x, uint128_signature<Tuint64_t>)
+{
+    const Tuint max_depthbits = 128;
+    using word_t = typename change_gpu_mode<Tuint64_t, T>::type;
+
+    Vector<Tuint, 3> depth = { (max_depthbits + 2) / 3, (max_depthbits + 1) / 3, (max_depthbits) / 3 };
+    array<word_t, 2> words = { 0, 0 };
+    for (Tuint k = 0; k < 3; ++k)
+    {
+        const Tuint64_t half = Tuint64_t(1) << (depth[k] - 1);
+        word_t s = word_t(abs(x[k]) * static_cast<T>(1.0 / (halflen * pow(2.0, Tdouble(2 - k) / 3)) * half));
+        myassert(s < 2 * half);
+        s = cond(x[k] > 0, s, half - 1 - s);
+        s |= word_t(x[k] > 0) << (depth[k] - 1);
+
+        for (Tuint w = 0; w < 2; ++w)
+        {
+            // Levels jbegin ... jend-1 of dimension k are in word w.
+            const Tuint t0 = 64 * w;
+            const Tuint jbegin = (t0 + 2 - k) / 3;
+            const Tuint jend = min((t0 + 66 - k) / 3, depth[k]);
+            const word_t part = (s >> (depth[k] - jend)) & ((Tuint64_t(1) << (jend - jbegin)) - 1);
+            words[w] |= spread_bits3(part) << (t0 + 63 - k - 3 * (jend - 1));
+        }
+    }
+    return uint128_signature<word_t>(words[0], words[1]);
+}
+#endif
+
 template<class signature_t, class T>
 auto calc_sig(const Vector<T, 3>& x, Tuint max_depthbits)
 {
     using sig_t = typename change_gpu_mode<signature_t, T>::type;
     assert(max_depthbits >= 3);
-    assert(max_depthbits <= get_size<sig_t>::value * 8);
+    assert(max_depthbits <= sizeof(signature_t) * 8);
     Vector<Tuint, 3> depth = { (max_depthbits + 2) / 3, (max_depthbits + 1) / 3, (max_depthbits) / 3 };
 
-    sig_t ret = calc_sig_fast<T>(x, signature_t()) >> (get_size<sig_t>::value * 8 - max_depthbits);
+    sig_t ret = calc_sig_fast<T>(x, signature_t()) >> Tuint(sizeof(signature_t) * 8 - max_depthbits);
 
-    if (DEBUG1)
+    // The reference calculation only covers single-word signatures.
+    if constexpr (DEBUG1 && sizeof(signature_t) <= 8)
     {
         sig_t cmp = 0;
         {
@@ -849,11 +1273,45 @@ gpu_uint find_particle_split(const resource<pair<signature_t, CTuint>>& particle
     return split;
 }
 
+/*
+  Reorders any number of per-particle arrays according to the sorted particle list in a single pass.
+  The index list is read once, and all arrays are gathered in the same loop.
+  Usage: permute(plist, size, in..., out...).
+ */
+template<class... V>
+struct particle_permutation
+{
+    kernel<void(const buffer<pair<signature_t, CTuint>>& plist, Tuint size, const buffer<V>&... in, buffer<V>&... out)>
+        func;
+
+    particle_permutation(goopax_device device)
+    {
+        func.assign(device,
+                    [](const resource<pair<signature_t, CTuint>>& plist,
+                       gpu_uint size,
+                       const resource<V>&... in,
+                       resource<V>&... out) {
+                        gpu_for_global(0, size, [&](gpu_uint k) {
+                            const gpu_uint src = plist[k].second;
+                            ((out[k] = in[src]), ...);
+                        });
+                    });
+    }
+
+    auto operator()(const buffer<pair<signature_t, CTuint>>& plist,
+                    Tuint size,
+                    const buffer<V>&... in,
+                    buffer<V>&... out)
+    {
+        return func(plist, size, in..., out...);
+    }
+};
+
 template<class T>
 struct cosmos_base
 {
     // static constexpr unsigned int gs_use = 4096;
-    static constexpr unsigned int ls_use = 64;
+    const Tuint ls_use = LS_USE();
     // static constexpr unsigned int ng_use = gs_use / ls_use;
 
     const Tuint sub_bits = log2_exact(ls_use) / 2;
@@ -865,42 +1323,253 @@ struct cosmos_base
     buffer<T> potential;
 #endif
     buffer<T> mass;
+    buffer<Vector<T, 3>> acc;
+    buffer<CTuint> timebin; // Time step of each particle is DT/2^timebin.
     buffer<Vector<T, 3>> tmp;
-    buffer<T> tmps; // FIXME: Reduce memory.
+    buffer<Vector<T, 3>> tmpv; // Not used in lean memory mode.
+    buffer<T> tmps;
+    buffer<CTuint> tmp_timebin;
+#if CALC_POTENTIAL
+    buffer<T> tmp_potential;
+#endif
+
+    // Storage of x, tmp and v. When the particles are sorted, the storages are exchanged instead of copied.
+    // 0 is the initial storage of x, 1 that of tmp, 2 that of v. In lean memory mode, the positions can end up in
+    // any of the three, otherwise only in 0 or 1.
+    array<Tuint, 3> storage = { 0, 1, 2 };
 
     buffer<pair<signature_t, CTuint>> plist1;
     buffer<pair<signature_t, CTuint>> plist2;
-    const Tsize_t treesize;
+    Tsize_t treesize; // Current capacity of the tree. Grows on demand in make_tree.
     static const unsigned int treecount_blocksize = 2; // FIXME: Increase to 2 or so.
 
     buffer<CTuint> blocksums;
     buffer<CTuint> bigblocksums;
-    buffer<CTuint> numsubbuf;
+    // Offset and size of each tree level, as pairs: tree_levels[2*depth] and tree_levels[2*depth+1].
+    // Written by treecount3 on the device, so that the tree can be built without host round trips.
+    buffer<CTuint> tree_levels;
 
     const Tuint tree_depthbits;
 
+    Tuint64_t step_count = 0;
+    Tdouble sim_time = 0;
+
+    Tuint min_active_bin = 0; // make_tree only calculates forces for particles with timebin >= min_active_bin.
+    bool acc_valid = false;   // Whether acc holds the forces of the current positions.
+
+    bool signatures_valid = false; // Whether plist1 already holds the signatures of x, written by the fused drift.
+    // Kick that the force calculation applies to the active particles once their forces are complete.
+    // kick_close_fac == 0 disables it. kick_done tells whether it was applied.
+    T kick_close_fac = 0;
+    T kick_open_fac = 0;
+    bool kick_done = false;
+    snapshot_writer<T> writer;
+
+    Tuint refit_count = 0;       // Number of refits since the last rebuild.
+    Tdouble refit_drift = 0;     // Upper bound of the particle displacement since the last rebuild.
+    Tdouble max_refit_drift = 0; // The tree is rebuilt when refit_drift exceeds this. Set by make_tree.
+    Tsize_t num_refits = 0;
+    Tsize_t num_rebuilds = 0;
+
+    // Sorts the particles, builds the tree and calculates the forces.
     virtual void make_tree() = 0;
 
+    // Exchanges two of x, tmp and v, together with their storage indices.
+    void swap_storage(buffer<Vector<T, 3>>& a, buffer<Vector<T, 3>>& b)
+    {
+        auto index = [&](const buffer<Vector<T, 3>>& c) { return (&c == &x ? 0 : (&c == &tmp ? 1 : 2)); };
+        swap(storage[index(a)], storage[index(b)]);
+        swap(a, b);
+    }
+
+    // Replaces the position storages by the given buffers, e.g. by buffers that are shared with the renderer.
+    // Needs two buffers (x and tmp), or three in lean memory mode (x, tmp and v). Must be called before the
+    // initial conditions are set.
+    void set_position_storage(vector<buffer<Vector<T, 3>>> buffers)
+    {
+        if (buffers.size() != (LEAN_MEMORY() ? 3u : 2u))
+        {
+            throw std::runtime_error("Wrong number of position storages");
+        }
+        x = std::move(buffers[0]);
+        tmp = std::move(buffers[1]);
+        if (LEAN_MEMORY())
+        {
+            v = std::move(buffers[2]);
+        }
+        storage = { 0, 1, 2 };
+    }
+
+    // Keeps the tree structure of the last make_tree, and only recalculates the multipoles and the forces.
+    // The particles are not reordered.
+    virtual void refit_tree() = 0;
+
+    // Adds a device that takes a share of the force calculation.
+    virtual void add_helper(goopax_device device) = 0;
+
+    // Friends-of-friends groups with at least min_members particles. See halo_finder.
+    virtual vector<halo> find_halos(Tdouble linking_length, Tuint min_members) = 0;
+
+    // Neighbor queries over the tree. See neighbor_search.
+    virtual neighbor_list radius_query(const buffer<Vector<T, 3>>& queries, T radius) = 0;
+    virtual void knn_query(const buffer<Vector<T, 3>>& queries, Tuint k, buffer<CTuint>& index, buffer<T>& dist2) = 0;
+
+    virtual ~cosmos_base() = default;
+
+    template<class U>
+    static Tsize_t bytes(const buffer<U>& b)
+    {
+        return b.size() * sizeof(U);
+    }
+
+    // Device memory of each buffer, in bytes.
+    virtual vector<pair<string, Tsize_t>> memory_usage() const
+    {
+        vector<pair<string, Tsize_t>> ret = { { "x", bytes(x) },
+                                              { "v", bytes(v) },
+#if CALC_POTENTIAL
+                                              { "potential", bytes(potential) },
+                                              { "tmp_potential", bytes(tmp_potential) },
+#endif
+                                              { "mass", bytes(mass) },
+                                              { "acc", bytes(acc) },
+                                              { "timebin", bytes(timebin) },
+                                              { "tmp", bytes(tmp) },
+                                              { "tmpv", bytes(tmpv) },
+                                              { "tmps", bytes(tmps) },
+                                              { "tmp_timebin", bytes(tmp_timebin) },
+                                              { "plist1", bytes(plist1) },
+                                              { "plist2", bytes(plist2) },
+                                              { "blocksums", bytes(blocksums) + bytes(bigblocksums) },
+                                              { "radix sort", Radix.memory_usage() },
+                                              { "incremental sort", Resort.memory_usage() } };
+        return ret;
+    }
+
+    void print_memory_report() const
+    {
+        Tsize_t total = 0;
+        cout << "Device memory:" << endl;
+        for (const auto& [name, b] : memory_usage())
+        {
+            cout << "  " << name << ": " << b / 1048576.0 << " MB" << endl;
+            total += b;
+        }
+        cout << "  total: " << total / 1048576.0 << " MB" << endl;
+    }
+
     kernel<void(buffer<Vector<T, 3>>& x,
                 buffer<Vector<T, 3>>& v, // FIXME: hard link.
                 Tuint size,
-                T dt)>
+                T dt,
+                goopax_future<T>& max_move2)>
         movefunc;
 
-    kernel<void(const buffer<Vector<T, 3>>& x, buffer<pair<signature_t, CTuint>>& plist, Tuint size)> sort1func;
+    // Drift, followed by the signature calculation of sort1func, in one pass over the particles.
+    kernel<void(buffer<Vector<T, 3>>& x,
+                buffer<Vector<T, 3>>& v,
+                buffer<pair<signature_t, CTuint>>& plist,
+                Tuint size,
+                T dt,
+                goopax_future<T>& max_move2)>
+        drift_sig_func;
 
-    kernel<void(const buffer<Vector<T, 3>>& in,
-                buffer<Vector<T, 3>>& out,
-                const buffer<pair<signature_t, CTuint>>& plist,
-                Tuint size)>
-        apply_vec;
+    kernel<void(const buffer<Vector<T, 3>>& x, buffer<pair<signature_t, CTuint>>& plist, Tuint size)> sort1func;
 
-    kernel<void(const buffer<T>& in, buffer<T>& out, const buffer<pair<signature_t, CTuint>>& plist, Tuint size)>
-        apply_scalar;
+    // Reorders x, v and mass after sorting.
+    particle_permutation<Vector<T, 3>, Vector<T, 3>, T> permute;
+    // With block time steps, time bins and potentials of inactive particles must be kept as well.
+#if CALC_POTENTIAL
+    particle_permutation<Vector<T, 3>, Vector<T, 3>, T, CTuint, T> permute_blocks;
+#else
+    particle_permutation<Vector<T, 3>, Vector<T, 3>, T, CTuint> permute_blocks;
+#endif
+    // Single arrays, for the lean memory mode.
+    particle_permutation<Vector<T, 3>> permute_vec;
+    particle_permutation<T> permute_scalar;
+    particle_permutation<CTuint> permute_uint;
+
+    kernel<void(buffer<Vector<T, 3>>& v,
+                const buffer<Vector<T, 3>>& acc,
+                buffer<CTuint>& timebin,
+                Tuint size,
+                Tuint min_active_bin,
+                T close_fac,
+                T open_fac)>
+        kickfunc;
 
     radix_sort<signature_t> Radix;
+    incremental_sort<signature_t> Resort;
+
+    // Moves particle k by v*dt. Particles leaving the box are pulled back and stopped. Returns the new position.
+    static Vector<gpu_T, 3>
+    drift_particle(resource<Vector<T, 3>>& x, resource<Vector<T, 3>>& v, gpu_uint k, gpu_T dt, gather_max<T>& max_move2)
+    {
+        const Vector<gpu_T, 3> dx = Vector<gpu_T, 3>(v[k]) * dt;
+        Vector<gpu_T, 3> xk = Vector<gpu_T, 3>(x[k]) + dx;
+        max_move2 = max(max_move2, dx.squaredNorm());
+
+        gpu_bool ok = true;
+        for (Tuint i = 0; i < 3; ++i)
+        {
+            ok = ok && (abs(xk[i]) <= halflen);
+            xk[i] = max(xk[i], -halflen);
+            xk[i] = min(xk[i], halflen);
+        }
+        gpu_if(!ok)
+        {
+            xk *= (gpu_T)0.99f;
+            v[k] = { 0, 0, 0 };
+        }
+        x[k] = xk;
+        return xk;
+    }
+
+    // Kick of particle k with acceleration a, if it is active. See kickfunc.
+    static void kick_particle(resource<Vector<T, 3>>& v,
+                              const Vector<gpu_T, 3>& a,
+                              resource<CTuint>& timebin,
+                              gpu_uint k,
+                              gpu_uint min_active_bin,
+                              gpu_T close_fac,
+                              gpu_T open_fac)
+    {
+        const gpu_uint bin = timebin[k];
+        gpu_if(bin >= min_active_bin)
+        {
+            v[k] += a * (close_fac * (gpu_T)DT() / gpu_T(gpu_uint(1) << bin));
+
+            // Desired time step dt = sqrt(2 eta eps / |a|).
+            // A particle may only move to a coarser bin if its next step is aligned,
+            // i.e. if the bin is currently active.
+            const gpu_T ratio =
+                (gpu_T)(DT() / sqrt(2 * TIMESTEP_ETA() * TIMESTEP_SOFTENING())) * sqrt(sqrt(a.squaredNorm()));
+            gpu_uint newbin = min_active_bin;
+            for (Tuint b = 0; b < MAX_TIMEBIN(); ++b)
+            {
+                newbin = cond(ratio > (T)(1u << b), max(newbin, gpu_uint(b + 1)), newbin);
+            }
+            timebin[k] = newbin;
+            v[k] += a * (open_fac * (gpu_T)DT() / gpu_T(gpu_uint(1) << newbin));
+        }
+    }
 
-    kernel<void(buffer<CTuint>& blocksums, buffer<CTuint>& bigblocksums, Tuint num_blocksums)> treecount2func;
+    kernel<void(buffer<CTuint>& blocksums,
+                buffer<CTuint>& bigblocksums,
+                const buffer<CTuint>& tree_levels,
+                Tuint depth,
+                Tuint tree_limit)>
+        treecount2func;
+
+    // Range of a tree level, clamped to the usable part of the tree.
+    // The clamping only takes effect after an overflow, in which case the host repeats the level.
+    static pair<gpu_uint, gpu_uint>
+    level_range(const resource<CTuint>& tree_levels, gpu_uint depth, gpu_uint tree_limit)
+    {
+        gpu_uint begin = min(tree_levels[2 * depth], tree_limit);
+        gpu_uint end = min(begin + tree_levels[2 * depth + 1], tree_limit);
+        return { begin, end };
+    }
 
     struct vicinity_data
     {
@@ -1099,6 +1768,7 @@ struct cosmos_base
         }
     };
 
+    const Tdouble max_distfac;
     const vicinity_data vdata;
     buffer<typename vicinity_data::index_t> vicinity_update_buffer;
     buffer<typename vicinity_data::index_t> vicinity_local_buffer;
@@ -1106,28 +1776,150 @@ struct cosmos_base
 
     kernel<void(const buffer<T>& potential, buffer<Vector<CTfloat, 4>>& color_gl, Tuint size)> extract_x_func;
 
+    /*
+      Advances by DT with hierarchical block time steps (kick-drift-kick).
+      The step is divided into 2^MAX_TIMEBIN substeps. A particle in time bin b is active every 2^(MAX_TIMEBIN-b)
+      substeps. At the end of the step, all particles are synchronized.
+     */
     void step()
     {
-        cout1 << "Moving." << endl;
-        movefunc(x, v, x.size(), 0.5 * DT());
-        cout1 << "Calculating force." << endl;
-        this->make_tree();
-        cout1 << "Moving." << endl;
-        movefunc(x, v, x.size(), 0.5 * DT());
+        const Tuint nsub = 1u << MAX_TIMEBIN();
+        Timings.step = step_count;
+        if (!acc_valid)
+        {
+            cout1 << "Calculating initial force." << endl;
+            min_active_bin = 0;
+            this->make_tree();
+            acc_valid = true;
+        }
+        // Opening half kick for all particles.
+        Timings.mark("kick", kickfunc(v, acc, timebin, x.size(), 0, 0, 0.5));
+        for (Tuint s = 1; s <= nsub; ++s)
+        {
+            cout1 << "Moving." << endl;
+            goopax_future<T> max_move2;
+            if (REFIT_INTERVAL() <= 1)
+            {
+                // The tree is rebuilt in any case, so the signatures are calculated in the same pass.
+                Timings.mark("drift", drift_sig_func(x, v, plist1, x.size(), DT() / nsub, max_move2));
+                signatures_valid = true;
+            }
+            else
+            {
+                Timings.mark("drift", movefunc(x, v, x.size(), DT() / nsub, max_move2));
+            }
+            min_active_bin = (s == nsub ? 0 : MAX_TIMEBIN() - countr_zero(s));
+            cout1 << "Calculating force for time bins >= " << min_active_bin << "." << endl;
+            // Closing half kick for the active particles, followed by the opening half kick of their next step.
+            // Applied by the force calculation if possible.
+            kick_close_fac = 0.5;
+            kick_open_fac = (s == nsub ? 0 : 0.5);
+            kick_done = false;
+            update_tree(max_move2);
+            kick_close_fac = 0;
+            if (!kick_done)
+            {
+                Timings.mark("kick",
+                             kickfunc(v, acc, timebin, x.size(), min_active_bin, 0.5, (s == nsub ? 0 : 0.5)));
+            }
+        }
+        ++step_count;
+        sim_time += DT();
     }
 
-    void make_IC(const char* filename = nullptr)
+    // Refits the tree if possible, otherwise rebuilds it.
+    void update_tree(goopax_future<T>& max_move2)
     {
-        goopax_device device = x.get_device();
-        size_t N = x.size();
-
-        std::default_random_engine generator;
-        std::normal_distribution<double> distribution;
-        std::uniform_real_distribution<double> distribution2;
-
-        if (filename)
+        if (REFIT_INTERVAL() > 1)
         {
-            v.fill({ 0, 0, 0 });
+            // Waiting for the drift kernel here. This only stalls the device briefly, the tree build already
+            // needs a host synchronization.
+            refit_drift += sqrt(Tdouble(max_move2.get()));
+            if (refit_count + 1 < REFIT_INTERVAL() && refit_drift <= max_refit_drift)
+            {
+                ++refit_count;
+                ++num_refits;
+                this->refit_tree();
+                return;
+            }
+        }
+        this->make_tree();
+    }
+
+    // Starts writing a snapshot. Returns before the file is written. Call writer.wait() to wait for completion.
+    void write_snapshot(const string& filename)
+    {
+        writer.write(filename,
+                     step_count,
+                     sim_time,
+                     x,
+                     v,
+                     mass,
+#if CALC_POTENTIAL
+                     &potential
+#else
+                     nullptr
+#endif
+        );
+    }
+
+    void load_snapshot(const string& filename)
+    {
+        cout << "Restarting from snapshot " << filename << endl;
+        mapped_snapshot snap(filename);
+        snap.header.check(sizeof(T), snap.size());
+        if (snap.header.num_particles != x.size())
+        {
+            throw std::runtime_error("Snapshot has " + to_string(snap.header.num_particles) + " particles, expected "
+                                     + to_string(x.size()));
+        }
+        x.copy_from_host(snap.get<Vector<T, 3>>(snap.header.offset_x));
+        v.copy_from_host(snap.get<Vector<T, 3>>(snap.header.offset_v));
+        mass.copy_from_host(snap.get<T>(snap.header.offset_mass));
+#if CALC_POTENTIAL
+        if (snap.header.flags & snapshot_has_potential)
+        {
+            potential.copy_from_host(snap.get<T>(snap.header.offset_potential));
+        }
+        else
+        {
+            potential.fill(0);
+        }
+#endif
+        step_count = snap.header.step;
+        sim_time = snap.header.time;
+        acc_valid = false;
+    }
+
+    // Sets the initial state, either from a restart snapshot or from make_IC.
+    void init_state(const char* ic_filename)
+    {
+        if (!RESTART().empty())
+        {
+            load_snapshot(RESTART());
+        }
+        else
+        {
+            make_IC(ic_filename);
+        }
+    }
+
+    void make_IC(const char* filename = nullptr)
+    {
+        goopax_device device = x.get_device();
+        acc_valid = false;
+        size_t N = x.size();
+
+        // The initial conditions are generated on the device. Each thread has its own generator state.
+        // A fixed seed keeps the initial conditions reproducible.
+        WELL512_data rnd(device, device.default_global_size_max(), 0);
+
+        // Uniform random number in [0,1].
+        auto uniform = [](gpu_uint r) { return static_cast<gpu_T>(r) * (T)(1.0 / 4294967296.0); };
+
+        if (filename)
+        {
+            v.fill({ 0, 0, 0 });
             cout << "Reading from file " << filename << endl;
 #if !WITH_OPENCV
             throw std::runtime_error("Need opencv to read images");
@@ -1141,48 +1933,95 @@ struct cosmos_base
             cv::Mat image_gray;
             cv::cvtColor(image_color, image_gray, cv::COLOR_BGR2GRAY);
 
-            uint max_extent = max(image_gray.rows, image_gray.cols);
-            Vector<double, 3> cm = { 0, 0, 0 };
-            buffer_map cx(this->x);
-            for (auto& r : cx)
+            // Alias table over the pixels, with the gray value as weight (Vose's method).
+            // The center of mass and the rms radius are computed from the same weights, so that the particles can be
+            // centered and scaled while they are sampled.
+            const Tuint width = image_gray.cols;
+            const Tuint num_pixels = image_gray.rows * image_gray.cols;
+            vector<Tdouble> weight(num_pixels);
+            Tdouble total = 0;
+            Vector<Tdouble, 2> mean = { 0, 0 };
+            Tdouble mean_r2 = 0;
+            for (Tuint p = 0; p < num_pixels; ++p)
             {
-                // cout << "." << flush;
-                while (true)
-                {
-                    for (auto& xx : r)
-                    {
-                        xx = distribution2(generator);
-                    }
-                    r[2] *= 0.1;
-                    Vector<int, 3> ri = (r * max_extent).template cast<int>();
-                    if (ri[0] < image_gray.cols && ri[1] < image_gray.rows)
-                    {
-                        uint8_t c = image_gray.at<uint8_t>(
-                            { static_cast<int>(r[0] * max_extent), static_cast<int>(r[1] * max_extent) });
-                        if (distribution2(generator) * 255 < c)
-                        {
-                            cm += r.template cast<double>();
-                            break;
-                        }
-                    }
-                }
+                weight[p] = image_gray.at<uint8_t>(p / width, p % width);
+                const Vector<Tdouble, 2> pos = { p % width + 0.5, p / width + 0.5 };
+                total += weight[p];
+                mean += weight[p] * pos;
+                mean_r2 += weight[p] * pos.squaredNorm();
             }
-            cm /= N;
-            for (auto& r : cx)
+            if (total == 0)
             {
-                r -= cm.cast<Tfloat>();
+                throw std::runtime_error("Image is black");
             }
-            double extent2 = 0;
-            for (auto& r : cx)
+            mean /= total;
+            mean_r2 /= total;
+
+            vector<CTfloat> prob(num_pixels);
+            vector<CTuint> alias(num_pixels);
+            vector<Tuint> small;
+            vector<Tuint> large;
+            for (Tuint p = 0; p < num_pixels; ++p)
             {
-                extent2 += r.squaredNorm();
+                weight[p] *= num_pixels / total;
+                alias[p] = p;
+                (weight[p] < 1 ? small : large).push_back(p);
             }
-            extent2 /= N;
-            for (auto& r : cx)
+            while (!small.empty() && !large.empty())
             {
-                r *= 0.5f / sqrt(extent2);
-                r[1] *= -1;
+                const Tuint s = small.back();
+                small.pop_back();
+                const Tuint l = large.back();
+                prob[s] = weight[s];
+                alias[s] = l;
+                weight[l] -= 1 - weight[s];
+                if (weight[l] < 1)
+                {
+                    large.pop_back();
+                    small.push_back(l);
+                }
             }
+            for (Tuint p : small)
+                prob[p] = 1;
+            for (Tuint p : large)
+                prob[p] = 1;
+
+            buffer<CTfloat> prob_buf(device, num_pixels);
+            buffer<CTuint> alias_buf(device, num_pixels);
+            prob_buf.copy_from_host(prob.data());
+            alias_buf.copy_from_host(alias.data());
+
+            // Positions in pixel units: pixel + uniform jitter in x and y, and a thickness of 0.1 * max_extent in z.
+            const Tdouble max_extent = max(image_gray.rows, image_gray.cols);
+            const Vector<Tdouble, 3> cm = { mean[0], mean[1], 0.05 * max_extent };
+            const Tdouble extent2 = mean_r2 - mean.squaredNorm() + 2.0 / 12 + pow2(0.1 * max_extent) / 12;
+            const Tdouble scale = 0.5 / sqrt(extent2);
+
+            kernel sample_image(device,
+                                [&rnd, &uniform](resource<Vector<T, 3>>& x,
+                                                 const resource<CTfloat>& prob,
+                                                 const resource<CTuint>& alias,
+                                                 gpu_uint width,
+                                                 gpu_T max_extent,
+                                                 gpu_T cm0,
+                                                 gpu_T cm1,
+                                                 gpu_T cm2,
+                                                 gpu_T scale) {
+                                    WELL512_lib rndlib(rnd);
+                                    gpu_for_global(0, x.size(), [&](gpu_uint k) {
+                                        const array<gpu_uint, 16> r = rndlib.generate();
+                                        gpu_uint p = gpu_uint((gpu_uint64(r[0]) * gpu_uint64(prob.size())) >> 32);
+                                        p = cond(uniform(r[1]) < prob[p], p, alias[p]);
+                                        const Vector<gpu_T, 3> pos = { static_cast<gpu_T>(p % width) + uniform(r[2]),
+                                                                       static_cast<gpu_T>(p / width) + uniform(r[3]),
+                                                                       uniform(r[4]) * max_extent * (T)0.1 };
+                                        // Image rows go downwards, so y is flipped.
+                                        x[k] = Vector<gpu_T, 3>({ (pos[0] - cm0) * scale,
+                                                                  -(pos[1] - cm1) * scale,
+                                                                  (pos[2] - cm2) * scale });
+                                    });
+                                });
+            sample_image(x, prob_buf, alias_buf, width, max_extent, cm[0], cm[1], cm[2], scale);
 #endif
         }
         else
@@ -1190,103 +2029,142 @@ struct cosmos_base
             Tint MODE = 2;
             if (MODE == 2)
             {
-                buffer_map x(this->x);
-                buffer_map v(this->v);
-                for (Tuint k = 0; k < N; ++k) // Setting the initial conditions:
-                { // N particles of mass 1/N each are randomly placed in a sphere of radius 1
-                    Vector<T, 3> xk;
-                    Vector<T, 3> vk;
-                    do
-                    {
-                        for (Tuint i = 0; i < 3; ++i)
+                // N particles of mass 1/N each are randomly placed in two rotating spheres of radius 1.
+                kernel galaxies(device, [&rnd](resource<Vector<T, 3>>& x, resource<Vector<T, 3>>& v) {
+                    WELL512_lib rndlib(rnd);
+                    const gpu_uint N = x.size();
+                    gpu_for_global(0, N, [&](gpu_uint k) {
+                        Vector<gpu_T, 3> xk;
+                        Vector<gpu_T, 3> vk;
+                        auto draw = [&]() {
+                            for (Tuint i = 0; i < 3; ++i)
+                            {
+                                xk[i] = static_cast<gpu_T>(rndlib.gaussian_distribution()) * (T)0.2;
+                                vk[i] = static_cast<gpu_T>(rndlib.gaussian_distribution()) * (T)0.2;
+                            }
+                        };
+                        draw();
+                        gpu_while(xk.squaredNorm() >= 1)
                         {
-                            xk[i] = distribution(generator) * 0.2;
-                            vk[i] = distribution(generator) * 0.2;
+                            draw();
                         }
-                    } while (xk.squaredNorm() >= 1);
-                    x[k] = xk;
-                    vk += Vector<T, 3>({ -xk[1], xk[0], 0 }) / (Vector<T, 3>({ -xk[1], xk[0], 0 })).norm() * 0.4f
-                          * min(xk.norm() * 10, (T)1);
-                    if (k < N / 2)
-                        vk = -vk;
-                    v[k] = vk;
-                    if (k < N / 2)
-                    {
-                        x[k] += Vector<T, 3>{ 0.8, 0.2, 0.0 };
-                        v[k] += Vector<T, 3>{ -0.4, 0.0, 0.0 };
-                    }
-                    else
-                    {
-                        x[k] -= Vector<T, 3>{ 0.8, 0.2, 0.0 };
-                        v[k] += Vector<T, 3>{ 0.4, 0.0, 0.0 };
-                    }
-                }
+                        const Vector<gpu_T, 3> rot = { -xk[1], xk[0], 0 };
+                        vk += rot * ((T)0.4 * min(sqrt(xk.squaredNorm()) * 10, gpu_T(1)) / sqrt(rot.squaredNorm()));
+
+                        // The first half of the particles form one galaxy, the second half the other one.
+                        const gpu_T sign = cond(k < N / 2, gpu_T(-1), gpu_T(1));
+                        x[k] = xk - Vector<gpu_T, 3>({ 0.8, 0.2, 0.0 }) * sign;
+                        v[k] = (vk + Vector<gpu_T, 3>({ 0.4, 0.0, 0.0 })) * sign;
+                    });
+                });
+                galaxies(x, v);
             }
             else if (MODE == 3)
             {
-                buffer_map x(this->x);
-                for (Tsize_t p = 0; p < this->x.size(); ++p)
-                {
-                    for (Tint k = 0; k < 3; ++k)
-                    {
-                        do
+                kernel gaussian(device, [&rnd](resource<Vector<T, 3>>& x) {
+                    WELL512_lib rndlib(rnd);
+                    gpu_for_global(0, x.size(), [&](gpu_uint p) {
+                        Vector<gpu_T, 3> xp;
+                        for (Tint k = 0; k < 3; ++k)
                         {
-                            x[p][k] = distribution(generator);
-                        } while (abs(x[p][k]) >= 1);
-                    }
-                }
+                            xp[k] = static_cast<gpu_T>(rndlib.gaussian_distribution());
+                            gpu_while(abs(xp[k]) >= 1)
+                            {
+                                xp[k] = static_cast<gpu_T>(rndlib.gaussian_distribution());
+                            }
+                        }
+                        x[p] = xp;
+                    });
+                });
+                gaussian(x);
                 v.fill({ 0, 0, 0 });
             }
         }
         mass.fill(1.0 / N);
     }
 
-    void precision_test()
+    struct precision_result
+    {
+        Tdouble time;             // Median time of make_tree in seconds
+        Tdouble force_err;        // Relative rms force error
+        Tdouble force_err_median; // Median of the relative force errors of the individual particles
+        Tdouble force_err_p99;    // 99th percentile of the relative force errors
+        Tdouble force_err_max;    // Largest relative force error
+        Tdouble pot_err;          // Absolute rms potential error
+    };
+
+    precision_result precision_test()
     {
         cout << "Doing precision test" << endl;
         goopax_device device = x.get_device();
 
-        kernel verify(device,
-                      [](const resource<Vector<T, 3>>& x,
-                         const resource<T>& mass,
-                         const resource<Vector<T, 3>>& force,
-#if CALC_POTENTIAL
-                         gather_add<TDOUBLE>& poterr,
-                         const resource<T>& potential,
-#endif
-                         gpu_uint pnum,
-                         gpu_uint np) -> gather_add<double> {
-                          GPU_DOUBLE ret = 0;
-#if CALC_POTENTIAL
-                          poterr = 0;
-#endif
-                          gpu_for_global(0, np, [&](gpu_uint p) {
-                              gpu_uint a = gpu_uint(gpu_uint64(pnum) * p / np);
-                              Vector<GPU_DOUBLE, 3> F = { 0, 0, 0 };
-                              GPU_DOUBLE P = 0;
-                              gpu_for(0, pnum, [&](gpu_uint b) {
-                                  auto distf = x[b] - x[a];
-                                  Vector<GPU_DOUBLE, 3> dist;
-                                  for (Tuint k = 0; k < 3; ++k)
-                                  {
-                                      dist[k] = (GPU_DOUBLE)(distf[k]);
-                                  }
-                                  F += static_cast<GPU_DOUBLE>(mass[b]) * dist * pow<-3, 2>(dist.squaredNorm() + 1E-20);
-                                  P += cond(b == a, 0., -mass[b] * pow<-1, 2>(dist.squaredNorm() + 1E-20));
-                              });
-                              ret += (force[a].template cast<GPU_DOUBLE>() * (1.0 / DT()) - F).squaredNorm();
-#if CALC_POTENTIAL
-                              poterr += pow2(potential[a] - P);
-#endif
-                          });
-                          return ret;
-                      });
+        // Direct summation for the sample particles. Each work group loads the particles in tiles into local memory,
+        // and every thread sums the contributions to its sample particle from the tile. The pair terms and the sums
+        // are evaluated in double, so that cancellation in dense regions does not affect the reference. With
+        // PRECISION_TEST_FLOAT, the pair terms are evaluated in T.
+        const bool pair_double = !PRECISION_TEST_FLOAT();
+        if (pair_double && !device.support_type(Tdouble()))
+        {
+            throw std::runtime_error("The precision test needs double precision. Use --precision_test_float=true");
+        }
+        kernel reference(device,
+                         [pair_double](const resource<Vector<T, 3>>& x,
+                            const resource<T>& mass,
+                            gpu_uint num_particles,
+                            gpu_uint num_samples,
+                            resource<Vector<CTDOUBLE, 3>>& ref_force,
+                            resource<CTDOUBLE>& ref_potential) {
+                             local_mem<Vector<T, 3>> tile_x(local_size());
+                             local_mem<T> tile_mass(local_size());
+                             const gpu_uint samples_end =
+                                 (num_samples + local_size() - 1) / local_size() * local_size();
+                             gpu_for(group_id() * local_size(), samples_end, global_size(), [&](gpu_uint base) {
+                                 const gpu_uint s = base + local_id();
+                                 const gpu_uint a =
+                                     gpu_uint(gpu_uint64(num_particles) * min(s, num_samples - 1) / num_samples);
+                                 const Vector<gpu_T, 3> xa = x[a];
+                                 Vector<GPU_DOUBLE, 3> F = { 0, 0, 0 };
+                                 GPU_DOUBLE P = 0;
+                                 gpu_for(0, num_particles, local_size(), [&](gpu_uint tile) {
+                                     const gpu_uint b = tile + local_id();
+                                     tile_x[local_id()] = x[min(b, num_particles - 1)];
+                                     tile_mass[local_id()] =
+                                         cond(b < num_particles, gpu_T(mass[min(b, num_particles - 1)]), gpu_T(0));
+                                     tile_x.barrier();
+                                     gpu_for(0, local_size(), [&](gpu_uint k) {
+                                         if (pair_double)
+                                         {
+                                             const Vector<GPU_DOUBLE, 3> dist =
+                                                 Vector<gpu_T, 3>(tile_x[k]).template cast<GPU_DOUBLE>()
+                                                 - xa.template cast<GPU_DOUBLE>();
+                                             const GPU_DOUBLE inv_r = pow<-1, 2>(dist.squaredNorm() + 1E-40);
+                                             const GPU_DOUBLE m = static_cast<GPU_DOUBLE>(gpu_T(tile_mass[k]));
+                                             F += dist * (m * pow3(inv_r));
+                                             P += cond(tile + k == a, 0., -m * inv_r);
+                                         }
+                                         else
+                                         {
+                                             const Vector<gpu_T, 3> dist = Vector<gpu_T, 3>(tile_x[k]) - xa;
+                                             const gpu_T inv_r = pow<-1, 2>(dist.squaredNorm() + (T)1E-20);
+                                             const gpu_T m = tile_mass[k];
+                                             F += (dist * (m * pow3(inv_r))).template cast<GPU_DOUBLE>();
+                                             P += cond(tile + k == a, 0., -static_cast<GPU_DOUBLE>(m * inv_r));
+                                         }
+                                     });
+                                     tile_x.barrier();
+                                 });
+                                 gpu_if(s < num_samples)
+                                 {
+                                     ref_force[s] = F;
+                                     ref_potential[s] = P;
+                                 }
+                             });
+                         });
 
         vector<Tdouble> tottimevec;
+        min_active_bin = 0;
         for (Tuint k = 0; k < 5; ++k)
         {
-            v.fill({ 0, 0, 0 });
-
             device.wait_all();
 
             auto t0 = steady_clock::now();
@@ -1299,20 +2177,133 @@ struct cosmos_base
         std::sort(tottimevec.begin(), tottimevec.end());
         cout << "tottime=" << tottimevec << endl;
 
-        const Tuint np = min(x.size(), (Tuint)100);
+        const Tuint N = x.size();
+        const Tuint np = min(N, PRECISION_SAMPLES());
+        buffer<Vector<CTDOUBLE, 3>> ref_force(device, np);
+        buffer<CTDOUBLE> ref_potential(device, np);
+        reference(x, mass, N, np, ref_force, ref_potential);
+
+        vector<Vector<CTDOUBLE, 3>> F(np);
+        vector<CTDOUBLE> P(np);
+        vector<Vector<T, 3>> force(N);
+        ref_force.copy_to_host(F.data());
+        ref_potential.copy_to_host(P.data());
+        acc.copy_to_host(force.data());
+#if CALC_POTENTIAL
+        vector<T> pot(N);
+        potential.copy_to_host(pot.data());
+#endif
 
-        goopax_future<Tdouble> poterr;
-        Tdouble tot = verify(x,
-                             mass,
-                             v,
+        Tdouble err2 = 0;
+        Tdouble fnorm2 = 0;
+        Tdouble poterr2 = 0;
+        vector<Tdouble> relerr(np);
+        for (Tuint s = 0; s < np; ++s)
+        {
+            const Tuint a = Tuint(Tuint64_t(N) * s / np);
+            Tdouble e2 = 0;
+            for (Tuint k = 0; k < 3; ++k)
+            {
+                e2 += pow2(force[a][k] - F[s][k]);
+            }
+            err2 += e2;
+            fnorm2 += F[s].squaredNorm();
+            relerr[s] = sqrt(e2 / (F[s].squaredNorm() + 1E-300));
 #if CALC_POTENTIAL
-                             poterr,
-                             potential,
+            poterr2 += pow2(pot[a] - P[s]);
 #endif
-                             x.size(),
-                             np)
-                          .get();
-        cout << "err=" << sqrt(tot / np) << ", poterr=" << sqrt(poterr.get() / np) << endl;
+        }
+        std::sort(relerr.begin(), relerr.end());
+
+        precision_result ret;
+        ret.time = tottimevec[tottimevec.size() / 2];
+        ret.force_err = sqrt(err2 / fnorm2);
+        ret.force_err_median = relerr[np / 2];
+        ret.force_err_p99 = relerr[min(np - 1, Tuint(np * 0.99))];
+        ret.force_err_max = relerr.back();
+        ret.pot_err = sqrt(poterr2 / np);
+        cout << "multipole storage: A,B in " << type_name<T>() << ", C,D,E in " << type_name<TMULTIPOLE_HIGH>() << endl;
+        cout << "samples=" << np << ", err=" << sqrt(err2 / np) << ", relative err=" << ret.force_err
+             << ", per particle: median=" << ret.force_err_median << ", p99=" << ret.force_err_p99
+             << ", max=" << ret.force_err_max << ", poterr=" << ret.pot_err << endl;
+        return ret;
+    }
+
+    // Compares the k-nearest-neighbor and radius queries at sample particles with brute force on the host.
+    void neighbor_test()
+    {
+        cout << "Doing neighbor test" << endl;
+        goopax_device device = x.get_device();
+        const Tsize_t N = x.size();
+        const Tuint k = 16;
+        const Tuint num_samples = min<Tsize_t>(256, N);
+
+        vector<Vector<T, 3>> host_x(N);
+        x.copy_to_host(host_x.data());
+        vector<Vector<T, 3>> host_queries(num_samples);
+        for (Tuint s = 0; s < num_samples; ++s)
+        {
+            host_queries[s] = host_x[Tsize_t(Tuint64_t(N) * s / num_samples)];
+        }
+        buffer<Vector<T, 3>> queries(device, num_samples);
+        queries.copy_from_host(host_queries.data());
+
+        buffer<CTuint> index;
+        buffer<T> dist2;
+        knn_query(queries, k, index, dist2);
+        vector<T> host_dist2(num_samples * k);
+        dist2.copy_to_host(host_dist2.data());
+
+        // Radius with about k neighbors per query.
+        vector<T> kth(num_samples);
+        for (Tuint s = 0; s < num_samples; ++s)
+        {
+            kth[s] = host_dist2[s * k + k - 1];
+        }
+        nth_element(kth.begin(), kth.begin() + num_samples / 2, kth.end());
+        const T radius = sqrt(kth[num_samples / 2]);
+        neighbor_list neighbors = radius_query(queries, radius);
+        vector<CTuint> offsets(num_samples + 1);
+        vector<CTuint> indices(neighbors.indices.size());
+        neighbors.offsets.copy_to_host(offsets.data());
+        neighbors.indices.copy_to_host(indices.data());
+
+        // The queries may have sorted the particles, and the indices refer to the new order.
+        x.copy_to_host(host_x.data());
+        const Tdouble tol = 1E-4;
+        const Tdouble r2 = Tdouble(radius) * radius;
+        Tsize_t knn_errors = 0;
+        Tsize_t radius_errors = 0;
+        vector<Tdouble> d2(N);
+        for (Tuint s = 0; s < num_samples; ++s)
+        {
+            for (Tsize_t j = 0; j < N; ++j)
+            {
+                d2[j] = (host_x[j] - host_queries[s]).template cast<Tdouble>().squaredNorm();
+            }
+            for (CTuint p = offsets[s]; p < offsets[s + 1]; ++p)
+            {
+                radius_errors += (d2[indices[p]] >= r2 * (1 + tol));
+            }
+            const Tsize_t num_found = offsets[s + 1] - offsets[s];
+            const Tsize_t num_inside = count_if(d2.begin(), d2.end(), [&](Tdouble d) { return d < r2 * (1 - tol); });
+            const Tsize_t num_border = count_if(d2.begin(), d2.end(), [&](Tdouble d) { return d < r2 * (1 + tol); });
+            radius_errors += (num_found < num_inside || num_found > num_border);
+
+            const Tuint kk = min<Tsize_t>(k, N);
+            nth_element(d2.begin(), d2.begin() + kk - 1, d2.end());
+            sort(d2.begin(), d2.begin() + kk);
+            for (Tuint m = 0; m < kk; ++m)
+            {
+                knn_errors += (abs(host_dist2[s * k + m] - d2[m]) > tol * d2[m] + 1E-12);
+            }
+        }
+        cout << "neighbor test: " << num_samples << " queries, k=" << k << ", radius=" << radius
+             << ", knn errors: " << knn_errors << ", radius errors: " << radius_errors << endl;
+        if (knn_errors != 0 || radius_errors != 0)
+        {
+            throw std::runtime_error("Neighbor test failed");
+        }
     }
 
     cosmos_base(goopax_device device, Tsize_t N, Tdouble max_distfac)
@@ -1324,45 +2315,93 @@ struct cosmos_base
         ,
 #endif
         mass(device, N)
+        , acc(device, N)
+        , timebin(device, N)
         , tmp(device, N)
+        , tmpv(device, LEAN_MEMORY() ? 0 : N)
         , tmps(device, N)
+        , tmp_timebin(device, MAX_TIMEBIN() != 0 ? N : 0)
+#if CALC_POTENTIAL
+        , tmp_potential(device, (MAX_TIMEBIN() != 0 && !LEAN_MEMORY()) ? N : 0)
+#endif
         ,
 
         plist1(device, N)
         , plist2(device, N)
-        , treesize(0.3 * N + 1000)
+        , treesize(4 * N / MAX_NODESIZE() + 1000)
         , blocksums(device, (treesize + treecount_blocksize - 1) / treecount_blocksize)
-        , numsubbuf(device, 1)
+        , tree_levels(device, 2 * (MAX_DEPTH() + 1))
         , tree_depthbits(MAX_DEPTH() - MAX_BIGNODE_BITS() - log2_exact(ls_use) / 2)
+        , permute(device)
+        , permute_blocks(device)
+        , permute_vec(device)
+        , permute_scalar(device)
+        , permute_uint(device)
         , Radix(device)
+        , Resort(device, N, INCREMENTAL_SORT_MAX_FRACTION())
+        , max_distfac(max_distfac)
         , vdata(max_distfac)
         , vicinity_update_buffer(device, vector(vdata.update_list))
         , vicinity_local_buffer(device, vector(vdata.local_list))
         , vicinity_access_buffer(device, vector(vdata.access_list))
 
     {
-        make_IC();
+        if (log2_exact(ls_use) % 2 != 0)
+        {
+            throw std::runtime_error("ls_use must be a power of 4");
+        }
+        if (MAX_BIGNODE_BITS() > sub_bits || MAX_BIGNODE_BITS() == 0)
+        {
+            throw std::runtime_error("max_bignode_bits must be between 1 and log2(ls_use)/2");
+        }
+        if (MAX_DEPTH() > sizeof(signature_t) * 8)
+        {
+            throw std::runtime_error(
+                "max_depth exceeds the signature size. Build with -DSIGNATURE_BITS=128 for deeper trees");
+        }
+        // The node positions in the downwards kernel are truncated by masking mantissa bits, one per 3 levels.
+        if (tree_depthbits > 3 * (numeric_limits<T>::digits - 2))
+        {
+            throw std::runtime_error("max_depth is too large for the floating point precision. The limit is "
+                                     + std::to_string(3 * (numeric_limits<T>::digits - 2) + MAX_BIGNODE_BITS()
+                                                      + log2_exact(ls_use) / 2));
+        }
+        timebin.fill(0);
 
         movefunc.assign(device,
                         [](resource<Vector<T, 3>>& x,
                            resource<Vector<T, 3>>& v, // FIXME: hard link.
                            gpu_uint size,
-                           gpu_T dt) {
-                            gpu_for_global(0, size, [&](gpu_uint k) {
-                                x[k] += Vector<gpu_T, 3>(v[k]) * dt;
+                           gpu_T dt,
+                           gather_max<T>& max_move2) {
+                            max_move2 = 0;
+                            gpu_for_global(0, size, [&](gpu_uint k) { drift_particle(x, v, k, dt, max_move2); });
+                        });
 
-                                gpu_bool ok = true;
-                                for (Tuint i = 0; i < 3; ++i)
-                                {
-                                    ok = ok && (abs(x[k][i]) <= halflen);
-                                    x[k][i] = max(x[k][i], -halflen);
-                                    x[k][i] = min(x[k][i], halflen);
-                                }
-                                gpu_if(!ok)
-                                {
-                                    x[k] *= (gpu_T)0.99f;
-                                    v[k] = { 0, 0, 0 };
-                                }
+        drift_sig_func.assign(device,
+                              [](resource<Vector<T, 3>>& x,
+                                 resource<Vector<T, 3>>& v,
+                                 resource<pair<signature_t, CTuint>>& plist,
+                                 gpu_uint size,
+                                 gpu_T dt,
+                                 gather_max<T>& max_move2) {
+                                  max_move2 = 0;
+                                  gpu_for_global(0, size, [&](gpu_uint k) {
+                                      const Vector<gpu_T, 3> xk = drift_particle(x, v, k, dt, max_move2);
+                                      plist[k] = make_pair(calc_sig<signature_t>(xk, MAX_DEPTH()), k);
+                                  });
+                              });
+
+        kickfunc.assign(device,
+                        [](resource<Vector<T, 3>>& v,
+                           const resource<Vector<T, 3>>& acc,
+                           resource<CTuint>& timebin,
+                           gpu_uint size,
+                           gpu_uint min_active_bin,
+                           gpu_T close_fac,
+                           gpu_T open_fac) {
+                            gpu_for_global(0, size, [&](gpu_uint k) {
+                                kick_particle(v, acc[k], timebin, k, min_active_bin, close_fac, open_fac);
                             });
                         });
 
@@ -1374,23 +2413,23 @@ struct cosmos_base
                 });
             });
 
-        apply_vec.assign(
-            device,
-            [](const resource<Vector<T, 3>>& in,
-               resource<Vector<T, 3>>& out,
-               const resource<pair<signature_t, CTuint>>& plist,
-               gpu_uint size) { gpu_for_global(0, size, [&](gpu_uint k) { out[k] = in[plist[k].second]; }); });
-
-        apply_scalar.assign(
-            device,
-            [](const resource<T>& in,
-               resource<T>& out,
-               const resource<pair<signature_t, CTuint>>& plist,
-               gpu_uint size) { gpu_for_global(0, size, [&](gpu_uint k) { out[k] = in[plist[k].second]; }); });
+        {
+            // The root node is at position 2. Further levels are written by treecount3.
+            buffer_map tree_levels(this->tree_levels);
+            tree_levels[0] = 2;
+            tree_levels[1] = 1;
+        }
 
         treecount2func.assign(
-            device, [](resource<CTuint>& blocksums, resource<CTuint>& bigblocksums, gpu_uint num_blocksums) {
+            device,
+            [](resource<CTuint>& blocksums,
+               resource<CTuint>& bigblocksums,
+               const resource<CTuint>& tree_levels,
+               gpu_uint depth,
+               gpu_uint tree_limit) {
                 assert(global_size() % treecount_blocksize == 0);
+                const auto [treebegin, treeend] = level_range(tree_levels, depth, tree_limit);
+                const gpu_uint num_blocksums = (treeend - treebegin + treecount_blocksize - 1) / treecount_blocksize;
                 gpu_for_global(0, num_blocksums, (global_size() / treecount_blocksize), [&](gpu_uint offset) {
                     gpu_uint sum = 0;
                     gpu_for(offset, min(offset + global_size() / treecount_blocksize, num_blocksums), [&](gpu_uint k) {
@@ -1432,14 +2471,16 @@ struct cosmos : public cosmos_base<T>
     using cosmos_base<T>::tmps;
     using cosmos_base<T>::blocksums;
     using cosmos_base<T>::bigblocksums;
-    using cosmos_base<T>::numsubbuf;
+    using cosmos_base<T>::tree_levels;
+    using cosmos_base<T>::level_range;
 
     buffer<treenode<T, max_multipole>> tree;
     buffer<treenode<T, max_multipole>> fill3;
 
     array<kernel<void(buffer<treenode<T, max_multipole>>& tree,
-                      Tuint treebegin,
-                      Tuint treeend,
+                      const buffer<CTuint>& tree_levels,
+                      Tuint depth,
+                      Tuint tree_limit,
                       // const gpu_uint max_super_particles,
                       buffer<CTuint>& blocksums)>,
           2>
@@ -1447,17 +2488,45 @@ struct cosmos : public cosmos_base<T>
 
     array<kernel<void(buffer<treenode<T, max_multipole>>& tree,
                       const buffer<pair<signature_t, CTuint>>& particles,
-                      Tuint treeoffset,
-                      Tuint treesize,
-                      Tuint tree_maxsize,
+                      buffer<CTuint>& tree_levels,
                       Tuint depth,
+                      Tuint tree_limit,
+                      Tuint sigdepth,
                       T halflen_sublevel,
                       const buffer<CTuint>& blocksums,
-                      const buffer<CTuint>& bigblocksums,
-                      buffer<CTuint>& numsub)>,
+                      const buffer<CTuint>& bigblocksums)>,
           3>
         treecount3;
 
+    Tuint last_tree_depth = 0; // Depth of the previous tree. Used to size the first batch of levels.
+    vector<pair<Tuint, Tuint>> treerange; // Node range of each tree level.
+
+    // Instances on further devices, see calc_forces.
+    vector<unique_ptr<cosmos>> helpers;
+    // Extracts the parts of the tree that the helpers need. Created on first use.
+    unique_ptr<essential_tree<T, treenode<T, max_multipole>>> essential;
+    unique_ptr<halo_finder<T, treenode<T, max_multipole>>> halos;         // Created on first use.
+    unique_ptr<neighbor_search<T, treenode<T, max_multipole>>> neighbors; // Created on first use.
+    unique_ptr<particle_mesh<T>> mesh;                                    // Created on first use, if PM_GRID is set.
+    const Tdouble pm_split;  // r_s of the TreePM split. 0 if the tree calculates all interactions.
+    const Tdouble pm_cutoff; // Range of the short-range forces with TreePM.
+
+    // Host copies for the transfers to and from the helpers.
+    vector<Vector<T, 3>> staging_x;
+    vector<Vector<T, 3>> staging_acc;
+    vector<T> staging_mass;
+    vector<T> staging_potential;
+    vector<pair<signature_t, CTuint>> staging_plist;
+    vector<CTuint> staging_timebin;
+    vector<treenode<T, max_multipole>> staging_tree;
+
+    // Geometric node centers of the last tree build, for refits. upwards overwrites them with the dipoles.
+    buffer<Vector<T, 3>> node_centers;
+    kernel<void(const buffer<treenode<T, max_multipole>>& tree, buffer<Vector<T, 3>>& centers, Tuint size)>
+        save_centers;
+    kernel<void(buffer<treenode<T, max_multipole>>& tree, const buffer<Vector<T, 3>>& centers, Tuint size)>
+        restore_centers;
+
     array<kernel<void(const buffer<treenode<T, max_multipole>>& tree,
                       const buffer<Vector<T, 3>>& x,
                       const Tuint begin,
@@ -1484,7 +2553,7 @@ struct cosmos : public cosmos_base<T>
 
         uint_type pbegin;
         uint_type pend;
-        multipole<U, max_multipole> Mr;
+        multipole<U, max_multipole> Mr; // Not traceless with TreePM, see add_local.
 
         template<class STREAM>
         friend STREAM& operator<<(STREAM& s, const local_treenode& n)
@@ -1500,7 +2569,7 @@ struct cosmos : public cosmos_base<T>
         GOOPAX_PREPARE_STRUCT2(vicinity_treenode, U)
         using uint_type = typename change_gpu_mode<unsigned int, U>::type;
 
-        multipole<U, max_multipole> Mr;
+        multipole_storage<U, max_multipole> Mr;
         uint_type first_child;
         uint_type pbegin;
         uint_type pend;
@@ -1573,155 +2642,687 @@ struct cosmos : public cosmos_base<T>
         }
     };
 
+    /*
+      Adds the local expansion of multipole M at distance vector a to L. diag bounds the sum of the half-diagonals of
+      both nodes.
+      With TreePM, only the short-range kernel erfc(r / 2r_s) / r is expanded, with the exact factor for each radial
+      derivative. Its local expansions are not harmonic, so they cannot be stored traceless. Node pairs that are
+      farther apart than the cutoff are left out.
+      Without TreePM, only the independent components of L are updated. The caller restores the others with
+      fill_traces after the last call.
+     */
+    void add_local(multipole<gpu_T, max_multipole>& L,
+                   const multipole<gpu_T, max_multipole>& M,
+                   const Vector<gpu_T, 3>& a,
+                   const gpu_T& diag) const
+    {
+        if (pm_split == 0)
+        {
+            L.add_independent(M.makelocal(a));
+            return;
+        }
+        const gpu_T r = sqrt(a.squaredNorm());
+        gpu_if(r - diag <= static_cast<T>(pm_cutoff))
+        {
+            const auto s = short_range_derivative_factors<max_multipole + 1>(r * static_cast<T>(0.5 / pm_split));
+            L += M.makelocal(a, s.data());
+        }
+    }
+
     kernel<void(buffer<treenode<T, max_multipole>>& tree,
                 buffer<local_treenode<T>>& local_tree,
                 buffer<vicinity_treenode<T>>& vicinity_tree,
                 const buffer<Vector<T, 3>>& x,
                 const buffer<pair<signature_t, CTuint>>& plist,
-                const Tuint num_particles,
+                Tuint first_particle,
+                Tuint end_particle,
                 const buffer<T>& mass,
 #if CALC_POTENTIAL
                 buffer<T>& potential,
 #endif
-                buffer<Vector<T, 3>>& v)>
-        downwards;
+                buffer<Vector<T, 3>>& acc,
+                buffer<Vector<T, 3>>& v,
+                buffer<CTuint>& timebin,
+                Tuint min_active_bin,
+                T close_fac,
+                T open_fac,
+                Tuint min_p2p_depth,
+                Tuint min_bit,
+                buffer<CTuint>& split_status)>
+        downwards;
+
+    Tuint sorted_min_bit = 0; // Signature bits below this were not sorted by the last tree build.
+    buffer<CTuint> split_status; // Set by downwards if it split a node by a signature bit below min_bit.
+
+    virtual void make_tree() final
+    {
+        if (!this->signatures_valid)
+        {
+            Timings.mark("signature", this->sort1func(x, plist1, x.size()));
+        }
+        this->signatures_valid = false;
+
+        // The bits below the leaves are only needed by the force calculation, which splits the leaves further.
+        // With SORT_DEPTH_MARGIN, the tree may grow by half the margin. If it grows deeper, or if the force
+        // calculation splits a node below the sorted bits (see split_status), it is rebuilt with all bits sorted.
+        const Tuint sort_depth = (SORT_DEPTH_MARGIN() != 0 && last_tree_depth != 0)
+                                     ? min(last_tree_depth + SORT_DEPTH_MARGIN(), MAX_DEPTH())
+                                     : MAX_DEPTH();
+        const Tuint min_bit = MAX_DEPTH() - sort_depth;
+        const Tuint depth_limit = (min_bit != 0 ? sort_depth - SORT_DEPTH_MARGIN() / 2 : MAX_DEPTH() - 1);
+        if (INCREMENTAL_SORT())
+        {
+            // x is still in the order of the previous step, so plist1 is almost sorted.
+            this->Resort(this->Radix, plist1, plist2, MAX_DEPTH(), min_bit);
+        }
+        else
+        {
+            this->Radix(plist1, plist2, MAX_DEPTH(), plist1.size(), min_bit);
+        }
+        sorted_min_bit = min_bit;
+
+        if (LEAN_MEMORY())
+        {
+            // One scratch buffer per type. After each swap, the old array serves as scratch for the next one.
+            const Tuint size = plist1.size();
+            this->permute_vec(plist1, size, x, tmp);
+            this->swap_storage(x, tmp);
+            this->permute_vec(plist1, size, v, tmp);
+            this->swap_storage(v, tmp);
+            auto permuted = this->permute_scalar(plist1, size, mass, tmps);
+            swap(mass, tmps);
+            if (MAX_TIMEBIN() != 0)
+            {
+                permuted = this->permute_uint(plist1, size, this->timebin, this->tmp_timebin);
+                swap(this->timebin, this->tmp_timebin);
+#if CALC_POTENTIAL
+                permuted = this->permute_scalar(plist1, size, potential, tmps);
+                swap(potential, tmps);
+#endif
+            }
+            Timings.mark("permute", permuted);
+        }
+        else
+        {
+            if (MAX_TIMEBIN() == 0)
+            {
+                Timings.mark("permute", this->permute(plist1, plist1.size(), x, v, mass, tmp, this->tmpv, tmps));
+            }
+            else
+            {
+                auto permuted = this->permute_blocks(plist1,
+                                                     plist1.size(),
+                                                     x,
+                                                     v,
+                                                     mass,
+                                                     this->timebin,
+#if CALC_POTENTIAL
+                                                     potential,
+#endif
+                                                     tmp,
+                                                     this->tmpv,
+                                                     tmps,
+                                                     this->tmp_timebin
+#if CALC_POTENTIAL
+                                                     ,
+                                                     this->tmp_potential
+#endif
+                );
+                Timings.mark("permute", permuted);
+                swap(this->timebin, this->tmp_timebin);
+#if CALC_POTENTIAL
+                swap(potential, this->tmp_potential);
+#endif
+            }
+            this->swap_storage(x, tmp);
+            swap(v, this->tmpv);
+            swap(mass, tmps);
+        }
+
+        treerange.clear();
+
+        {
+            tree.copy(fill3, 3, 0, 0);
+
+            // The levels are built in batches without waiting for the device in between.
+            // The level sizes are read back once per batch. The first batch covers the depth of the previous tree,
+            // so that usually a single synchronization suffices.
+            vector<CTuint> levels(tree_levels.size());
+            Tuint depth = 0;
+            Tuint batch = last_tree_depth + 2;
+            bool done = false;
+            while (!done)
+            {
+                const Tuint depth_end = min(depth + batch, depth_limit);
+                const Tuint tree_limit = tree.size() - tree_margin();
+                for (Tuint d = depth; d < depth_end; ++d)
+                {
+                    this->treecount1[d < this->sub_bits + MAX_BIGNODE_BITS()](
+                        tree, tree_levels, d, tree_limit, blocksums);
+
+                    cout1 << "after treecount1:\nblocksums=" << blocksums << endl;
+                    this->treecount2func(blocksums, bigblocksums, tree_levels, d, tree_limit);
+                    cout1 << "after treecount2:\nblocksums=" << blocksums << endl;
+                    cout1 << "bigblocksums=" << bigblocksums << endl;
+
+                    auto counted = treecount3[d % 3](tree,
+                                                     plist1,
+                                                     tree_levels,
+                                                     d,
+                                                     tree_limit,
+                                                     MAX_DEPTH() - d - 1,
+                                                     halflen * pow(2.0, (-1 - Tint(d)) / 3.0),
+                                                     blocksums,
+                                                     bigblocksums);
+                    if (d + 1 == depth_end)
+                    {
+                        Timings.mark("treecount", counted);
+                    }
+                }
+
+                tree_levels.copy_to_host(levels.data());
+                Timings.restart();
+
+                for (; depth < depth_end; ++depth)
+                {
+                    const Tuint num_sub = levels[2 * depth + 3];
+                    cout1 << "\ndepth " << depth << ": tree[" << levels[2 * depth] << "..."
+                          << levels[2 * depth] + levels[2 * depth + 1] << "], num_sub=" << num_sub << endl;
+
+                    // treecount1 of the next level writes up to tree_margin nodes beyond the end.
+                    const Tsize_t required = Tsize_t(levels[2 * depth + 2]) + num_sub + tree_margin();
+                    if (required > tree.size())
+                    {
+                        // The children did not fit. Growing the tree and redoing the batch from this level.
+                        // Nodes of this level and above are preserved, treecount1 recomputes the child offsets.
+                        grow_tree(required);
+                        break;
+                    }
+                    if (num_sub == 0)
+                    {
+                        done = true;
+                        break;
+                    }
+                }
+                if (depth == depth_limit)
+                {
+                    done = true;
+                }
+                batch = TREE_LEVELS_PER_SYNC();
+            }
+
+            for (Tuint d = 0; d <= depth; ++d)
+            {
+                treerange.push_back(make_pair(levels[2 * d], levels[2 * d] + levels[2 * d + 1]));
+            }
+            last_tree_depth = depth;
+            if (REFIT_INTERVAL() > 1)
+            {
+                save_centers(tree, node_centers, treerange.back().second);
+            }
+
+#ifndef NDEBUG
+            static Tuint testcount = 0;
+
+            if (testcount++ % 1024 == 0)
+            {
+                cout << "treetest" << endl;
+                for (Tuint d = 0; d < treerange.size(); ++d)
+                {
+                    Vector<T, 3> boxsize;
+                    for (Tuint k = 0; k < 3; ++k)
+                    {
+                        boxsize[k] = halflen * (pow(2.0, -Tint(d + 2 - k) / 3 + (2.0 - k) / 3.0) + 1E-7);
+                    }
+                    cout1 << "boxsize=" << boxsize << endl;
+                    treetest[d % 3](tree, x, treerange[d].first, treerange[d].second, boxsize);
+                }
+            }
+#endif
+        }
+
+        if (min_bit != 0 && treerange.size() > depth_limit)
+        {
+            cout1 << "Tree reached depth " << depth_limit << ", sorting all signature bits." << endl;
+            last_tree_depth = MAX_DEPTH();
+            make_tree();
+            return;
+        }
+
+        if (treerange.size() > MAX_DEPTH())
+        {
+            cerr << "treerange.size()=" << treerange.size() << " > MAX_DEPTH=" << MAX_DEPTH() << endl;
+            throw std::runtime_error("MAX_DEPTH exceeded");
+        }
+
+        this->refit_count = 0;
+        this->refit_drift = 0;
+        this->max_refit_drift = REFIT_MAX_DRIFT() * halflen * pow(2.0, -1.0 / 3 * treerange.size());
+        ++this->num_rebuilds;
+
+        update_multipoles();
+        calc_forces();
+    }
+
+    virtual void refit_tree() final
+    {
+        restore_centers(tree, node_centers, treerange.back().second);
+        update_multipoles();
+        calc_forces();
+    }
+
+    void update_multipoles()
+    {
+        Tdouble level_halflen = halflen * pow(2.0, -1.0 / 3 * treerange.size());
+        for (Tuint depth = treerange.size() - 1; depth != Tuint(-1); --depth)
+        {
+            auto up = upwards[(3000000 + depth - 1 - this->sub_bits) % 3][depth == treerange.size() - 1](
+                tree, x, mass, treerange[depth].first, treerange[depth].second, level_halflen);
+            if (depth == 0)
+            {
+                Timings.mark("upwards", up);
+            }
+            level_halflen *= pow(2.0, 1.0 / 3);
+        }
+    }
+
+    // level_halflen of update_multipoles for the vicinity nodes at depth_bm, i.e. the tree nodes at depth
+    // depth_bm + sub_bits + MAX_BIGNODE_BITS - 1. Scale of their stored multipoles.
+    gpu_T node_halflen(gpu_uint depth_bm) const
+    {
+        return static_cast<T>(halflen)
+               * exp2(-static_cast<gpu_T>(depth_bm + this->sub_bits + MAX_BIGNODE_BITS()) * static_cast<T>(1.0 / 3));
+    }
+
+    /*
+      With helper devices, each device calculates the forces for a contiguous range of the sorted particle list,
+      i.e. for a contiguous signature range. Each helper receives the essential tree of its range: the top levels,
+      the nodes and multipoles of the vicinity of its range, and the particles that it needs for the direct
+      summation. Only the forces of its range are collected afterwards.
+      Only the force calculation is distributed. This device keeps all particles and builds the full tree, so the
+      memory capacity does not scale with the number of devices. The essential trees go through the host at every
+      force calculation.
+     */
+    void calc_forces()
+    {
+        const Tuint N = plist1.size();
+        const Tuint num_devices = helpers.size() + 1;
+        auto slice = [&](Tuint d) { return Tuint(Tuint64_t(N) * d / num_devices); };
+
+        // The helpers are started first, so that they run while this device calculates its own range.
+        vector<typename essential_tree<T, treenode<T, max_multipole>>::result> sent(helpers.size());
+        if (!helpers.empty())
+        {
+            if (!essential)
+            {
+                essential = make_unique<essential_tree<T, treenode<T, max_multipole>>>(
+                    x.get_device(), halflen, essential_grid_cells(), essential_local_cells(), this->sub_bits);
+            }
+            // Direct summation is done near the leaves, where the particles of the vicinity are few.
+            const Tuint max_depth = treerange.size() - 1;
+            const Tuint top_depth = this->sub_bits + MAX_BIGNODE_BITS();
+            const Tuint p2p_depth =
+                min(max(Tuint(log2(max(Tdouble(N) / (8 * MAX_NODESIZE()), 1.0))), top_depth), max_depth);
+            const Tuint min_p2p_depth = p2p_depth + 1 - min(p2p_depth + 1, top_depth);
+
+            for (Tuint d = 1; d < num_devices; ++d)
+            {
+                cosmos& H = *helpers[d - 1];
+                sent[d - 1] = (*essential)(tree,
+                                           x,
+                                           mass,
+                                           plist1,
+                                           this->timebin,
+                                           this->acc,
+#if CALC_POTENTIAL
+                                           potential,
+#else
+                                           tmps, // Not in use at this point.
+#endif
+                                           2,
+                                           treerange,
+                                           slice(d),
+                                           slice(d + 1),
+                                           1 + (1u << top_depth),
+                                           p2p_depth,
+                                           this->max_refit_drift);
+                send_essential_tree(H, sent[d - 1]);
+                const Tuint first = sent[d - 1].first_particle;
+                H.downwards(H.tree,
+                            H.local_tree,
+                            H.vicinity_tree,
+                            H.x,
+                            H.plist1,
+                            first,
+                            first + (slice(d + 1) - slice(d)),
+                            H.mass,
+#if CALC_POTENTIAL
+                            H.potential,
+#endif
+                            H.acc,
+                            H.v,
+                            H.timebin,
+                            this->min_active_bin,
+                            0,
+                            0,
+                            min_p2p_depth,
+                            sorted_min_bit,
+                            H.split_status);
+            }
+        }
+
+        // The kick can only be fused if all forces are calculated by the tree on this device, and if the step cannot
+        // be redone.
+        const bool fused_kick = helpers.empty() && pm_split == 0 && this->kick_close_fac != 0 && sorted_min_bit == 0;
+        Timings.mark("downwards",
+                     downwards(tree,
+                               local_tree,
+                               vicinity_tree,
+                               x,
+                               plist1,
+                               0,
+                               slice(1),
+                               mass,
+#if CALC_POTENTIAL
+                               potential,
+#endif
+                               this->acc,
+                               v,
+                               this->timebin,
+                               this->min_active_bin,
+                               (fused_kick ? this->kick_close_fac : 0),
+                               this->kick_open_fac,
+                               0,
+                               sorted_min_bit,
+                               split_status));
+        this->kick_done = fused_kick;
+
+        // Collecting the forces of the helper ranges. The buffers of the essential tree are free at this point.
+        for (Tuint d = 1; d < num_devices; ++d)
+        {
+            cosmos& H = *helpers[d - 1];
+            const Tuint first = sent[d - 1].first_particle;
+            const Tuint end = first + (slice(d + 1) - slice(d));
+            staging_acc.resize(end);
+            essential->reserve(essential->acc, end);
+            H.acc.copy_to_host(staging_acc.data(), 0, end);
+            essential->acc.copy_from_host(staging_acc.data(), 0, end);
+            this->acc.copy(essential->acc, end - first, first, slice(d));
+#if CALC_POTENTIAL
+            staging_potential.resize(end);
+            essential->reserve(essential->potential, end);
+            H.potential.copy_to_host(staging_potential.data(), 0, end);
+            essential->potential.copy_from_host(staging_potential.data(), 0, end);
+            potential.copy(essential->potential, end - first, first, slice(d));
+#endif
+        }
+
+        // A node was split by a signature bit that was not sorted. The step is redone with all bits sorted.
+        if (sorted_min_bit != 0 && split_failed())
+        {
+            cout1 << "Force calculation reached the unsorted signature bits, sorting all signature bits." << endl;
+            last_tree_depth = MAX_DEPTH();
+            make_tree();
+            return;
+        }
+
+        if (pm_split != 0)
+        {
+            if (!mesh)
+            {
+                mesh = make_unique<particle_mesh<T>>(x.get_device(), halflen, PM_GRID(), PM_SPLIT());
+                cout << "TreePM: r_s=" << pm_split << ", cutoff=" << pm_cutoff
+                     << ", short-range force fraction at the cutoff=" << short_range_factors(0.5 * PM_CUTOFF()).second
+                     << endl;
+            }
+            mesh->add_forces(x,
+                             mass,
+                             this->acc,
+#if CALC_POTENTIAL
+                             potential,
+#else
+                             tmps, // Not in use at this point.
+#endif
+                             this->timebin,
+                             this->min_active_bin);
+        }
+    }
+
+    // Whether any device raised split_status in the last downwards call. Resets the flags.
+    bool split_failed()
+    {
+        bool ret = false;
+        auto check = [&](buffer<CTuint>& status) {
+            CTuint flag;
+            status.copy_to_host(&flag, 0, 1);
+            ret = ret || flag != 0;
+            status.fill(0);
+        };
+        check(split_status);
+        for (auto& H : helpers)
+        {
+            check(H->split_status);
+        }
+        return ret;
+    }
+
+    /*
+      Copies the essential tree from this device to helper H. Devices do not share memory, so the data goes through
+      the host. The buffers of H grow as needed.
+     */
+    void send_essential_tree(cosmos& H, const typename essential_tree<T, treenode<T, max_multipole>>::result& e)
+    {
+        const goopax_device device = H.x.get_device();
+        auto transfer = [&](const auto& src, auto& dest, auto& staging, Tuint size) {
+            if (dest.size() < size)
+            {
+                dest.assign(device, size + size / 4);
+            }
+            staging.resize(size);
+            src.copy_to_host(staging.data(), 0, size);
+            dest.copy_from_host(staging.data(), 0, size);
+        };
+        transfer(essential->tree, H.tree, staging_tree, e.num_nodes);
+        transfer(essential->x, H.x, staging_x, e.num_particles);
+        transfer(essential->mass, H.mass, staging_mass, e.num_particles);
+        transfer(essential->plist, H.plist1, staging_plist, e.num_particles);
+        transfer(essential->timebin, H.timebin, staging_timebin, e.num_particles);
+        if (MAX_TIMEBIN() != 0)
+        {
+            // Inactive particles keep their forces. The helpers must not overwrite them with stale values.
+            transfer(essential->acc, H.acc, staging_acc, e.num_particles);
+#if CALC_POTENTIAL
+            transfer(essential->potential, H.potential, staging_potential, e.num_particles);
+#endif
+        }
+        else
+        {
+            if (H.acc.size() < e.num_particles)
+            {
+                H.acc.assign(device, e.num_particles + e.num_particles / 4);
+            }
+#if CALC_POTENTIAL
+            if (H.potential.size() < e.num_particles)
+            {
+                H.potential.assign(device, e.num_particles + e.num_particles / 4);
+            }
+#endif
+        }
+    }
 
-    virtual void make_tree() final
+    // Extent of the vicinity grid around a bignode, in grid cells. One more bignode is added, because bignodes next
+    // to those of the own range are visited as well.
+    Tuint essential_grid_cells() const
     {
-        this->sort1func(x, plist1, x.size());
-        this->Radix(plist1, plist2, MAX_DEPTH());
-
-        this->apply_vec(x, tmp, plist1, plist1.size());
-        swap(x, tmp);
-        this->apply_vec(v, tmp, plist1, plist1.size());
-        swap(v, tmp);
-        this->apply_scalar(mass, tmps, plist1, plist1.size());
-        swap(mass, tmps);
-
-        static vector<pair<Tuint, Tuint>> treerange;
-        treerange.clear();
-        Tuint treesize = 1;
-        Tuint treeoffset = 2;
-
-#if WITH_TIMINGS
-        x.get_device().wait_all();
-        auto t0 = steady_clock::now();
-#endif
+        const Tint bignode_cells = 1 << ((MAX_BIGNODE_BITS() + 2) / 3);
+        const Vector<Tint, 3>& m = this->vdata.maxvec;
+        return max(max(m[0], m[1]), m[2]) + 2 * bignode_cells;
+    }
 
+    // Farthest direct summation partner, in grid cells.
+    Tuint essential_local_cells() const
+    {
+        const auto& vd = this->vdata;
+        Tint ret = 0;
+        for (Tuint id : vd.local_list)
         {
-            tree.copy(fill3, 3, 0, 0);
-
-            for (Tuint depth = 0; depth < MAX_DEPTH(); ++depth)
+            const Vector<Tint, 3> pos = { Tint(id % vd.sizevec[0]),
+                                          Tint(id / vd.sizevec[0] % vd.sizevec[1]),
+                                          Tint(id / vd.sizevec[0] / vd.sizevec[1]) };
+            for (Tuint k = 0; k < 3; ++k)
             {
-                treerange.push_back(make_pair(treeoffset, treeoffset + treesize));
-                cout1 << "\ndepth " << depth << ": tree[" << treeoffset << "..." << treeoffset + treesize << "]=";
-                if (depth == MAX_DEPTH() - 1)
-                    break;
-
-                this->treecount1[depth < this->sub_bits + MAX_BIGNODE_BITS()](
-                    tree, treeoffset, treeoffset + treesize, blocksums);
-
-                cout1 << "after treecount1:\nblocksums=" << blocksums << endl;
-                this->treecount2func(
-                    blocksums, bigblocksums, (treesize + treecount_blocksize - 1) / treecount_blocksize);
-                cout1 << "after treecount2:\nblocksums=" << blocksums << endl;
-                cout1 << "bigblocksums=" << bigblocksums << endl;
-
-                treecount3[depth % 3](tree,
-                                      plist1,
-                                      treeoffset,
-                                      treesize,
-                                      tree.size(),
-                                      MAX_DEPTH() - depth - 1,
-                                      halflen * pow(2.0, (-1 - Tint(depth)) / 3.0),
-                                      blocksums,
-                                      bigblocksums,
-                                      numsubbuf);
-
-                const_buffer_map<Tuint> numsubbuf(this->numsubbuf);
-                const Tuint num_sub = numsubbuf[0];
-                cout1 << "num_sub=" << num_sub << endl;
-
-                assert(treeoffset + treesize + num_sub <= tree.size()); // FIXME: Make dynamic.
-
-                Vector<T, 3> boxsize;
-                for (Tuint k = 0; k < 3; ++k)
-                {
-                    boxsize[k] = halflen * (pow(2.0, -Tint(depth + 2 - k) / 3 + (2.0 - k) / 3.0) + 1E-7);
-                }
-                cout1 << "boxsize=" << boxsize << endl;
-
-#ifndef NDEBUG
-                static Tuint testcount = 0;
-
-                if (testcount++ % 1024 == 0)
-                {
-                    cout << "treetest" << endl;
-                    treetest[depth % 3](tree, x, treeoffset, treeoffset + treesize, boxsize);
-                }
-#endif
+                ret = max(ret, abs(pos[k] - vd.maxvec[k]));
+            }
+        }
+        return ret;
+    }
 
-                treeoffset += treesize;
-                treesize = num_sub;
+    // Helpers start without particles. They receive essential trees, see calc_forces.
+    virtual void add_helper(goopax_device device) final
+    {
+        helpers.push_back(make_unique<cosmos>(device, 0, this->max_distfac));
+    }
 
-                if (num_sub == 0)
-                    break;
-            }
+    // The tree queries need particles that are sorted into the current tree. After refits, they may have left their
+    // nodes, so the tree is rebuilt.
+    void sort_into_tree()
+    {
+        if (!this->acc_valid || this->refit_count != 0)
+        {
+            this->make_tree();
+            this->acc_valid = true;
         }
+    }
 
-#if WITH_TIMINGS
-        x.get_device().wait_all();
-        auto t1 = steady_clock::now();
-#endif
+    virtual neighbor_list radius_query(const buffer<Vector<T, 3>>& queries, T radius) final
+    {
+        sort_into_tree();
+        if (!neighbors)
+        {
+            neighbors = make_unique<neighbor_search<T, treenode<T, max_multipole>>>(x.get_device(), halflen);
+        }
+        return neighbors->radius_query(tree, 2, treerange.size() - 1, x, queries, radius);
+    }
 
+    virtual void
+    knn_query(const buffer<Vector<T, 3>>& queries, Tuint k, buffer<CTuint>& index, buffer<T>& dist2) final
+    {
+        sort_into_tree();
+        if (!neighbors)
         {
-            Tdouble level_halflen = halflen * pow(2.0, -1.0 / 3 * treerange.size());
-            for (Tuint depth = treerange.size() - 1; depth != Tuint(-1); --depth)
-            {
-                upwards[(3000000 + depth - 1 - this->sub_bits) % 3][depth == treerange.size() - 1](
-                    tree, x, mass, treerange[depth].first, treerange[depth].second, level_halflen);
-                level_halflen *= pow(2.0, 1.0 / 3);
-            }
+            neighbors = make_unique<neighbor_search<T, treenode<T, max_multipole>>>(x.get_device(), halflen);
         }
+        neighbors->knn_query(tree, 2, treerange.size() - 1, x, queries, k, index, dist2);
+    }
 
-#if WITH_TIMINGS
-        x.get_device().wait_all();
-        auto t2 = steady_clock::now();
-#endif
+    virtual vector<halo> find_halos(Tdouble linking_length, Tuint min_members) final
+    {
+        sort_into_tree();
+        if (!halos)
+        {
+            halos = make_unique<halo_finder<T, treenode<T, max_multipole>>>(x.get_device(), halflen);
+        }
+        return (*halos)(tree, 2, treerange.size() - 1, x, v, mass, linking_length, min_members);
+    }
 
-        if (treerange.size() > MAX_DEPTH())
+    vector<pair<string, Tsize_t>> memory_usage() const override
+    {
+        vector<pair<string, Tsize_t>> ret = cosmos_base<T>::memory_usage();
+        ret.push_back({ "tree", this->bytes(tree) });
+        ret.push_back({ "node_centers", this->bytes(node_centers) });
+        ret.push_back({ "local_tree", this->bytes(local_tree) });
+        ret.push_back({ "vicinity_tree", this->bytes(vicinity_tree) });
+        if (mesh)
         {
-            cerr << "treerange.size()=" << treerange.size() << " > MAX_DEPTH=" << MAX_DEPTH() << endl;
-            throw std::runtime_error("MAX_DEPTH exceeded");
+            ret.push_back({ "particle_mesh", mesh->memory_usage() });
+        }
+        if (essential)
+        {
+            ret.push_back({ "essential_tree", essential->memory_usage() });
         }
+        return ret;
+    }
 
-        downwards(tree,
-                  local_tree,
-                  vicinity_tree,
-                  x,
-                  plist1,
-                  plist1.size(),
-                  mass,
+    // Estimated device memory for N particles, in bytes, following the allocations in the constructors.
+    // Buffers that grow on demand (the tree beyond its initial size, the radix sort ranges) are not included.
+    static Tsize_t estimate_memory(goopax_device device, Tsize_t N, Tdouble max_distfac)
+    {
+        const Tuint ls = LS_USE();
+        const Tsize_t num_sub = 1u << (log2_exact(ls) / 2);
+        const Tsize_t depthbits = MAX_DEPTH() - MAX_BIGNODE_BITS() - log2_exact(ls) / 2;
+        const Tsize_t num_groups = device.default_global_size_max() / ls; // Upper bound for the downwards kernel.
+        const Tsize_t treesize = 4 * N / MAX_NODESIZE() + 1000;
+        const vicinity_data vd(max_distfac);
+
+        // x, v, acc, tmp, mass, tmps, timebin, plist1, plist2
+        Tsize_t per_particle =
+            4 * sizeof(Vector<T, 3>) + 2 * sizeof(T) + sizeof(CTuint) + 2 * sizeof(pair<signature_t, CTuint>);
+        if (!LEAN_MEMORY())
+            per_particle += sizeof(Vector<T, 3>); // tmpv
 #if CALC_POTENTIAL
-                  potential,
+        per_particle += sizeof(T);
+        if (MAX_TIMEBIN() != 0 && !LEAN_MEMORY())
+            per_particle += sizeof(T); // tmp_potential
 #endif
-                  v);
+        if (MAX_TIMEBIN() != 0)
+            per_particle += sizeof(CTuint); // tmp_timebin
+
+        Tsize_t ret = N * per_particle;
+        ret += 2 * Tsize_t(N * INCREMENTAL_SORT_MAX_FRACTION()) * sizeof(pair<signature_t, CTuint>);
+        ret += treesize
+               * (sizeof(treenode<T, max_multipole>) + sizeof(CTuint) / treecount_blocksize
+                  + (REFIT_INTERVAL() > 1 ? sizeof(Vector<T, 3>) : 0));
+        ret += num_groups * depthbits * num_sub
+               * ((1u << MAX_BIGNODE_BITS()) * sizeof(local_treenode<T>) + vd.size * sizeof(vicinity_treenode<T>));
+        if (PM_GRID() != 0)
+        {
+            ret += particle_mesh<T>::estimate_memory(halflen, PM_GRID());
+        }
+        return ret;
+    }
+
+    Tsize_t tree_margin() const
+    {
+        return treecount_blocksize * treecount1[0].local_size();
+    }
+
+    // Grows the tree geometrically to at least min_size nodes, keeping the existing nodes.
+    // The allocation is kept across steps, so this only happens while the clustering increases.
+    void grow_tree(Tsize_t min_size)
+    {
+        goopax_device device = tree.get_device();
+        const Tsize_t new_size = max(min_size, static_cast<Tsize_t>(tree.size() * TREE_GROWTH()));
+        cout1 << "Growing tree from " << tree.size() << " to " << new_size << " nodes." << endl;
 
-#if WITH_TIMINGS
-        x.get_device().wait_all();
-        auto t3 = steady_clock::now();
+        buffer<treenode<T, max_multipole>> new_tree(device, new_size);
+        new_tree.copy(tree, tree.size(), 0, 0);
+        swap(tree, new_tree);
 
-        cout << "treecount: " << duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << endl;
-        cout << "upwards: " << duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms" << endl;
-        cout << "downwards: " << duration_cast<std::chrono::milliseconds>(t3 - t2).count() << " ms" << endl;
-#endif
+        this->treesize = new_size;
+        blocksums.assign(device, (new_size + treecount_blocksize - 1) / treecount_blocksize);
+        if (REFIT_INTERVAL() > 1)
+        {
+            node_centers.assign(device, new_size);
+        }
+        bigblocksums.assign(device,
+                            (new_size + this->treecount2func.global_size() - 1) / this->treecount2func.global_size());
     }
 
     cosmos(goopax_device device, Tsize_t N, Tdouble max_distfac)
         : cosmos_base<T>(device, N, max_distfac)
         , tree(device, this->treesize)
         , fill3(device, 3)
+        , pm_split(PM_GRID() != 0 ? PM_SPLIT() * particle_mesh<T>::mesh_cellsize(halflen, PM_GRID()) : 0)
+        , pm_cutoff(PM_CUTOFF() * pm_split)
+        , node_centers(device, REFIT_INTERVAL() > 1 ? this->treesize : 0)
+        , split_status(device, 1)
     {
+        split_status.fill(0);
+        if (!device.support_type(TMULTIPOLE_HIGH()))
+        {
+            throw std::runtime_error(string("Device does not support ") + type_name<TMULTIPOLE_HIGH>()
+                                     + " for the multipole storage");
+        }
 
         {
             buffer_map fill3(this->fill3);
@@ -1745,10 +3346,12 @@ struct cosmos : public cosmos_base<T>
             treecount1[is_top].assign(
                 device,
                 [is_top](resource<treenode<T, max_multipole>>& tree,
-                         gpu_uint treebegin,
-                         gpu_uint treeend,
+                         const resource<CTuint>& tree_levels,
+                         gpu_uint depth,
+                         gpu_uint tree_limit,
                          // const gpu_uint max_super_particles,
                          resource<CTuint>& blocksums) {
+                    const auto [treebegin, treeend] = level_range(tree_levels, depth, tree_limit);
                     array<gpu_bool, treecount_blocksize> has_children_vec;
                     gpu_for(treecount_blocksize * local_size() * group_id(),
                             treeend - treebegin,
@@ -1786,14 +3389,15 @@ struct cosmos : public cosmos_base<T>
                 device,
                 [mod3](resource<treenode<T, max_multipole>>& tree,
                        const resource<pair<signature_t, CTuint>>& particles,
-                       gpu_uint treeoffset,
-                       gpu_uint treesize,
-                       gpu_uint tree_maxsize,
+                       resource<CTuint>& tree_levels,
                        gpu_uint depth,
+                       gpu_uint tree_limit,
+                       gpu_uint sigdepth,
                        gpu_T halflen_sublevel,
                        const resource<CTuint>& blocksums,
-                       const resource<CTuint>& bigblocksums,
-                       resource<CTuint>& numsub) {
+                       const resource<CTuint>& bigblocksums) {
+                    const auto [treeoffset, treeend] = level_range(tree_levels, depth, tree_limit);
+                    const gpu_uint treesize = treeend - treeoffset;
                     gpu_uint offsetsum = 0;
                     gpu_for_global(0, treesize, [&](gpu_uint k) {
                         tree[treeoffset + k].first_child =
@@ -1805,34 +3409,42 @@ struct cosmos : public cosmos_base<T>
                         {
                             const gpu_uint end =
                                 find_particle_split(particles, n.pbegin, n.pend, [&](gpu_signature_t id) {
-                                    return ((id & (gpu_signature_t(1u) << depth)) == 0);
+                                    return ((id & (gpu_signature_t(1u) << sigdepth)) == 0);
                                 });
 
-                            gpu_bool ok = (n.first_child + 1 < tree_maxsize);
-                            gpu_assert(ok);
-                            for (Tuint childnum : { 0, 1 })
+                            // On overflow, the children are not written. The host detects this from tree_levels,
+                            // grows the tree and repeats the level.
+                            gpu_bool ok = (n.first_child + 1 < tree_limit);
+                            gpu_if(ok)
                             {
-                                auto& c = tree[cond(ok, n.first_child + childnum, treeoffset + k)];
-                                Vector<gpu_T, 3> center = n.Mr.B;
-                                for (Tuint dir : { 0, 1, 2 })
-                                    if (mod3 == dir)
-                                        center[dir] += (childnum == 0 ? -halflen_sublevel : halflen_sublevel);
-                                c.Mr.B = center;
-                                if (childnum == 0)
+                                for (Tuint childnum : { 0, 1 })
                                 {
-                                    c.pbegin = n.pbegin;
-                                    c.pend = end;
-                                }
-                                else
-                                {
-                                    c.pbegin = end;
-                                    c.pend = n.pend;
+                                    auto& c = tree[n.first_child + childnum];
+                                    Vector<gpu_T, 3> center = n.Mr.B;
+                                    for (Tuint dir : { 0, 1, 2 })
+                                        if (mod3 == dir)
+                                            center[dir] += (childnum == 0 ? -halflen_sublevel : halflen_sublevel);
+                                    c.Mr.B = center;
+                                    if (childnum == 0)
+                                    {
+                                        c.pbegin = n.pbegin;
+                                        c.pend = end;
+                                    }
+                                    else
+                                    {
+                                        c.pbegin = end;
+                                        c.pend = n.pend;
+                                    }
                                 }
                             }
                         }
                         offsetsum += bigblocksums[k / global_size()];
                     });
-                    gpu_if(global_id() == 0) numsub[0] = offsetsum;
+                    gpu_if(global_id() == 0)
+                    {
+                        tree_levels[2 * depth + 2] = treeend;
+                        tree_levels[2 * depth + 3] = offsetsum;
+                    }
                 },
                 this->treecount2func.local_size(),
                 this->treecount2func.global_size());
@@ -1864,6 +3476,7 @@ struct cosmos : public cosmos_base<T>
                                             gpu_uint treebegin,
                                             gpu_uint treeend,
                                             gpu_T level_halflen) {
+                        const gpu_T child_halflen = level_halflen * static_cast<T>(pow(2.0, -1.0 / 3));
                         gpu_for_global(treebegin, treeend, [&](gpu_uint t) {
                             const gpu_bool is_pnode = (is_bottom || tree[t].first_child == 0);
 
@@ -1877,19 +3490,34 @@ struct cosmos : public cosmos_base<T>
                             });
                             gpu_for(0, cond(is_pnode, 0u, 2u), [&](gpu_uint child) {
                                 const gpu_uint child_id = tree[t].first_child + child;
-                                const multipole<gpu_T, max_multipole> Mcr = tree[child_id].Mr;
+                                const multipole<gpu_T, max_multipole> Mcr =
+                                    unpack_node_multipole<gpu_T, max_multipole>(tree[child_id].Mr, child_halflen);
                                 Vector<gpu_T, 3> shift_r = { level_halflen * (1 - gpu_int(2 * child)), 0, 0 };
                                 multipole<gpu_T, max_multipole> Mr =
                                     Mcr.rot(-1).shift_ext(rot(shift_r, Tint(-1 - this->sub_bits)));
                                 Msum_r += Mr;
                             });
 
-                            tree[t].Mr = Msum_r;
+                            tree[t].Mr = pack_node_multipole(Msum_r, level_halflen);
                         });
                     });
             }
         }
 
+        save_centers.assign(device,
+                            [](const resource<treenode<T, max_multipole>>& tree,
+                               resource<Vector<T, 3>>& centers,
+                               gpu_uint size) {
+                                gpu_for_global(0, size, [&](gpu_uint k) { centers[k] = tree[k].Mr.B; });
+                            });
+
+        restore_centers.assign(device,
+                               [](resource<treenode<T, max_multipole>>& tree,
+                                  const resource<Vector<T, 3>>& centers,
+                                  gpu_uint size) {
+                                   gpu_for_global(0, size, [&](gpu_uint k) { tree[k].Mr.B = centers[k]; });
+                               });
+
         downwards.assign(
             device,
             [this](resource<treenode<T, max_multipole>>& tree,
@@ -1897,12 +3525,21 @@ struct cosmos : public cosmos_base<T>
                    resource<vicinity_treenode<T>>& vicinity_tree,
                    const resource<Vector<T, 3>>& x,
                    const resource<pair<signature_t, CTuint>>& plist,
-                   const gpu_uint num_particles,
+                   gpu_uint first_particle,
+                   gpu_uint end_particle,
                    const resource<T>& mass,
 #if CALC_POTENTIAL
                    resource<T>& potential,
 #endif
-                   resource<Vector<T, 3>>& v) {
+                   resource<Vector<T, 3>>& acc,
+                   resource<Vector<T, 3>>& v,
+                   resource<CTuint>& timebin,
+                   gpu_uint min_active_bin,
+                   gpu_T close_fac,
+                   gpu_T open_fac,
+                   gpu_uint min_p2p_depth,
+                   gpu_uint min_bit,
+                   resource<CTuint>& split_status) {
                 vector<gpu_uint> COUNT(13, 0);
                 using bignodeshift_and_t = typename std::conditional<sizeof(T) == 8, gpu_uint64, gpu_uint>::type;
 
@@ -1924,8 +3561,10 @@ struct cosmos : public cosmos_base<T>
 
                 const Tuint local_offset = vdata.maxvec[0] + vdata.maxvec[1] * vdata.sizevec[0]
                                            + vdata.maxvec[2] * vdata.sizevec[1] * vdata.sizevec[0];
-                const gpu_uint pbegin = gpu_uint(gpu_uint64(num_particles) * group_id() / num_groups());
-                const gpu_uint pend = gpu_uint(gpu_uint64(num_particles) * (group_id() + 1) / num_groups());
+                // Each group handles a part of the particle range [first_particle, end_particle).
+                const gpu_uint64 range_size = gpu_uint64(end_particle - first_particle);
+                const gpu_uint pbegin = first_particle + gpu_uint(range_size * group_id() / num_groups());
+                const gpu_uint pend = first_particle + gpu_uint(range_size * (group_id() + 1) / num_groups());
                 const Vector<Tuint, 3> bitvec = { (MAX_BIGNODE_BITS() + 2) / 3,
                                                   (MAX_BIGNODE_BITS() + 0) / 3,
                                                   (MAX_BIGNODE_BITS() + 1) / 3 };
@@ -1973,6 +3612,7 @@ struct cosmos : public cosmos_base<T>
                 {
                     ++COUNT[0];
                     const gpu_uint vicinity_offset = group_id() * tree_depthbits * vdata.size + depth_bm * vdata.size;
+                    const gpu_T vicinity_halflen = this->node_halflen(depth_bm);
                     gpu_bool bignode_is_child1 = ((id_bignode & 1u) != 0);
 
                     gpu_uint totnum_particles = 0;
@@ -2034,9 +3674,12 @@ struct cosmos : public cosmos_base<T>
                                 ++COUNT[3];
                                 const gpu_uint vtp_pb = vicinity_tree[vt_parent_p * num_sub + parent_sub].pbegin;
                                 const gpu_uint vtp_pe = vicinity_tree[vt_parent_p * num_sub + parent_sub].pend;
-                                const gpu_signature_t bitmask =
-                                    (gpu_signature_t(1)
-                                     << (MAX_DEPTH() - depth_bm - MAX_BIGNODE_BITS() - this->sub_bits + 1));
+                                const gpu_uint bit = MAX_DEPTH() - depth_bm - MAX_BIGNODE_BITS() - this->sub_bits + 1;
+                                const gpu_signature_t bitmask = (gpu_signature_t(1) << bit);
+                                gpu_if(bit < min_bit && vtp_pe - vtp_pb > 1)
+                                {
+                                    split_status[0] = 1;
+                                }
                                 const gpu_uint end = find_particle_split(
                                     plist, vtp_pb, vtp_pe, [&](gpu_signature_t id) { return ((id & bitmask) == 0); });
                                 vt_child.pbegin = cond((sub & 1) == 0, vtp_pb, end);
@@ -2045,13 +3688,15 @@ struct cosmos : public cosmos_base<T>
                                 {
                                     gpu_if(child_mod3 == mod3)
                                     {
-                                        vt_child.Mr = multipole<T, max_multipole>::from_particle({ 0, 0, 0 }, 0);
+                                        multipole<gpu_T, max_multipole> M =
+                                            multipole<T, max_multipole>::from_particle({ 0, 0, 0 }, 0);
 
                                         gpu_for(vt_child.pbegin, vt_child.pend, [&](gpu_uint p) {
                                             ++COUNT[4];
-                                            vt_child.Mr += multipole<gpu_T, max_multipole>::from_particle(
+                                            M += multipole<gpu_T, max_multipole>::from_particle(
                                                 rot(x[p], mod3) - vt_child_center_r, mass[p], p);
                                         });
+                                        vt_child.Mr = pack_node_multipole(M, vicinity_halflen);
                                     }
                                 }
                                 vt_child.first_child = 0;
@@ -2077,9 +3722,12 @@ struct cosmos : public cosmos_base<T>
                                      * num_sub]
                               .pbegin;
 
+                    // Above min_p2p_depth, the particles for the direct summation may be missing (see
+                    // essential_tree).
                     const gpu_bool step_in = (gpu_float(totnum_particles) * num_own_particles
-                                              > 2 * vdata.access_list.size() * num_sub * (1 << MAX_BIGNODE_BITS())
-                                                    * num_sub * MULTIPOLE_COSTFAC());
+                                                  > 2 * vdata.access_list.size() * num_sub * (1 << MAX_BIGNODE_BITS())
+                                                        * num_sub * MULTIPOLE_COSTFAC()
+                                              || (depth_bm < min_p2p_depth && num_own_particles != 0));
                     const gpu_uint other_sub = local_id() / num_sub;
 
                     assert((1u << MAX_BIGNODE_BITS()) <= num_sub);
@@ -2127,8 +3775,8 @@ struct cosmos : public cosmos_base<T>
                                               + depth_bm * (1 << MAX_BIGNODE_BITS()) + child;
 
                         const multipole<gpu_T, max_multipole> oldMr =
-                            local_tree[lt_parent_p * num_sub + parent_sub].Mr.rot();
-                        local_tree[lt_p * num_sub + sub].Mr = oldMr.shift_loc(shift_r);
+                            multipole<gpu_T, max_multipole>(local_tree[lt_parent_p * num_sub + parent_sub].Mr).rot();
+                        local_tree[lt_p * num_sub + sub].Mr = oldMr.shift_loc(shift_r, pm_split == 0);
 
                         const gpu_uint begin = max(min(lt_pb, pend), pbegin);
                         const gpu_uint end = max(min(lt_pe, pend), pbegin);
@@ -2159,9 +3807,16 @@ struct cosmos : public cosmos_base<T>
                             newMr = local_tree[lt_p * num_sub + sub].Mr;
                         }
 
-                        if (true)
+                        // TreePM: No update node is within the cutoff on the upper levels. The closest ones are
+                        // max_distfac * 2^(-1/3) vicinity units apart (see vicinity_data), i.e. half max_distfac
+                        // times the smallest position width.
+                        const gpu_T position_diag = sqrt(COORDS.shiftvec.squaredNorm());
+                        const gpu_T min_update_gap =
+                            min(min(COORDS.shiftvec[0], COORDS.shiftvec[1]), COORDS.shiftvec[2])
+                            * static_cast<T>(0.5 * this->max_distfac);
+                        local_mem<multipole_storage<T, max_multipole>> vicinity_cache(local_size());
+                        gpu_if(gpu_bool(pm_split == 0) || min_update_gap <= static_cast<T>(pm_cutoff))
                         {
-                            local_mem<multipole<T, max_multipole>> vicinity_cache(local_size());
                             gpu_for(0, vdata.update_list.size() / num_sub, [&](gpu_uint vubase) {
                                 ++COUNT[6];
                                 gpu_uint v = vicinity_update_list[vubase * num_sub + other_sub];
@@ -2185,8 +3840,11 @@ struct cosmos : public cosmos_base<T>
                                     const Vector<gpu_T, 3> vicinity_center_r =
                                         bignode_center_r + COORDS.getpos_r(localpos) + COORDS.getsubshift_r(other_sub);
 
-                                    newMr += vicinity_cache[s * num_sub + other_sub].makelocal(center_child_r
-                                                                                               - vicinity_center_r);
+                                    add_local(newMr,
+                                              unpack_node_multipole<gpu_T, max_multipole>(
+                                                  vicinity_cache[s * num_sub + other_sub], vicinity_halflen),
+                                              center_child_r - vicinity_center_r,
+                                              position_diag);
                                 });
 
                                 vicinity_cache.barrier();
@@ -2219,8 +3877,11 @@ struct cosmos : public cosmos_base<T>
                                     const Vector<gpu_T, 3> vicinity_center_r =
                                         bignode_center_r + COORDS.getpos_r(localpos) + COORDS.getsubshift_r(other_sub);
 
-                                    newMr += vicinity_cache[s * num_sub + other_sub].makelocal(center_child_r
-                                                                                               - vicinity_center_r);
+                                    add_local(newMr,
+                                              unpack_node_multipole<gpu_T, max_multipole>(
+                                                  vicinity_cache[s * num_sub + other_sub], vicinity_halflen),
+                                              center_child_r - vicinity_center_r,
+                                              position_diag);
                                 });
 
                                 vicinity_cache.barrier();
@@ -2228,6 +3889,10 @@ struct cosmos : public cosmos_base<T>
                                 // multiple nodes?
                             }
                         }
+                        if (pm_split == 0)
+                        {
+                            newMr.fill_traces();
+                        }
 
                         for (Tuint shift = local_size() / 2; shift >= num_sub; shift /= 2)
                         {
@@ -2248,22 +3913,26 @@ struct cosmos : public cosmos_base<T>
                                 gpu_if(child_mod3 == mod3)
                                 {
                                     gpu_for(pbegin + other_sub, pend, num_sub, [&](gpu_uint p) {
-                                        Vector<gpu_T, 3> F =
-                                            rot(newMr.calc_force(rot(x[p], mod3) - center_child_r), -(Tint)mod3);
+                                        gpu_if(timebin[p] >= min_active_bin)
+                                        {
+                                            Vector<gpu_T, 3> F =
+                                                rot(newMr.calc_force(rot(x[p], mod3) - center_child_r), -(Tint)mod3);
 #if CALC_POTENTIAL
-                                        const gpu_T pot_r = newMr.calc_loc_potential(rot(x[p], mod3) - center_child_r);
+                                            const gpu_T pot_r =
+                                                newMr.calc_loc_potential(rot(x[p], mod3) - center_child_r);
 #endif
-                                        v[p] += F * (gpu_T)DT();
+                                            acc[p] = F;
 #if CALC_POTENTIAL
-                                        potential[p] = pot_r;
+                                            potential[p] = pot_r;
 #endif
+                                        }
                                     });
                                 }
                             }
                         }
                     });
                     local_tree.barrier();
-                    v.barrier();
+                    acc.barrier();
 #if CALC_POTENTIAL
                     potential.barrier();
 #endif
@@ -2294,6 +3963,16 @@ struct cosmos : public cosmos_base<T>
                                     //++COUNT[ID+0];
                                     vector<Vector<gpu_T, 3>> F(blocksize, { 0, 0, 0 });
                                     vector<gpu_T> P(blocksize, 0);
+
+                                    // Skipping blocks without active particles.
+                                    gpu_bool any_active = false;
+                                    for (Tuint k = 0; k < blocksize; ++k)
+                                    {
+                                        any_active = any_active
+                                                     || (timebin[min(a + k, end_particle - 1)] >= min_active_bin);
+                                    }
+                                    use = use && any_active;
+
                                     gpu_if(use)
                                     {
                                         gpu_for(0, vdata.local_list.size(), [&](gpu_uint locu) {
@@ -2308,13 +3987,15 @@ struct cosmos : public cosmos_base<T>
                                                         for (Tuint k = 0; k < blocksize; ++k)
                                                         {
                                                             const Vector<gpu_T, 3> dist = x[b] - x[a + k];
-                                                            F[k] += dist
-                                                                    * (mass[b] * pow<-1, 2>(dist.squaredNorm() + 1E-20f)
-                                                                       * pow2(pow<-1, 2>(dist.squaredNorm() + 1E-20f)));
-                                                            P[k] += cond(
-                                                                b == a + k,
-                                                                0.f,
-                                                                -(mass[b] * pow<-1, 2>(dist.squaredNorm() + 1E-20f)));
+                                                            const gpu_T inv_r = pow<-1, 2>(dist.squaredNorm() + 1E-20f);
+                                                            // TreePM: short-range part only.
+                                                            const pair<gpu_T, gpu_T> f =
+                                                                (pm_split == 0 ? pair<gpu_T, gpu_T>(1, 1)
+                                                                               : short_range_factors(
+                                                                                     dist.squaredNorm() * inv_r
+                                                                                     * static_cast<T>(0.5 / pm_split)));
+                                                            F[k] += dist * (mass[b] * pow3(inv_r) * f.second);
+                                                            P[k] += cond(b == a + k, 0.f, -(mass[b] * inv_r * f.first));
                                                         }
                                                     });
                                         });
@@ -2340,10 +4021,13 @@ struct cosmos : public cosmos_base<T>
                                                     totF += LF[(t + local_id() - tid) * blocksize + k];
                                                     totP += LP[(t + local_id() - tid) * blocksize + k];
                                                 }
-                                                v[a + k] += totF * (gpu_T)DT();
+                                                gpu_if(timebin[a + k] >= min_active_bin)
+                                                {
+                                                    acc[a + k] += totF;
 #if CALC_POTENTIAL
-                                                potential[a + k] += totP;
+                                                    potential[a + k] += totP;
 #endif
+                                                }
                                             });
                                         }
                                         LF.barrier(); // FIXME: Shouldn't be necessary.
@@ -2353,10 +4037,13 @@ struct cosmos : public cosmos_base<T>
                                     {
                                         for (Tuint k = 0; k < blocksize; ++k)
                                         {
-                                            v[a + k] += F[k] * (gpu_T)DT();
+                                            gpu_if(timebin[a + k] >= min_active_bin)
+                                            {
+                                                acc[a + k] += F[k];
 #if CALC_POTENTIAL
-                                            potential[a + k] += P[k];
+                                                potential[a + k] += P[k];
 #endif
+                                            }
                                         }
                                     }
                                 };
@@ -2437,6 +4124,16 @@ struct cosmos : public cosmos_base<T>
                         gpu_assert(depth_bm < tree_depthbits);
                     }
                 }
+
+                // The forces of the particles in [pbegin, pend) are written by this group only, so they are complete
+                // here. Kicking them now saves a separate pass over the particles.
+                gpu_if(close_fac != 0)
+                {
+                    acc.barrier();
+                    gpu_for_local(pbegin, pend, [&](gpu_uint k) {
+                        this->kick_particle(v, acc[k], timebin, k, min_active_bin, close_fac, open_fac);
+                    });
+                }
             },
             this->ls_use);
 
@@ -2450,61 +4147,426 @@ struct cosmos : public cosmos_base<T>
             { .pbegin = 0, .pend = numeric_limits<typename multipole<T, max_multipole>::uint_type>::max(), .Mr = {} });
 
         vicinity_tree.fill({ .Mr = {}, .first_child = 0, .pbegin = 0, .pend = 0 });
+
+        if (tree.size() < 3 + tree_margin())
+        {
+            grow_tree(3 + tree_margin());
+        }
     }
 };
 
+// Creates the simulation with the given multipole order. All orders are compiled in.
+template<class T>
+unique_ptr<cosmos_base<T>> make_cosmos(goopax_device device, Tsize_t N, Tdouble max_distfac, Tuint order)
+{
+    switch (order)
+    {
+        case 1:
+            return make_unique<cosmos<T, 1>>(device, N, max_distfac);
+        case 2:
+            return make_unique<cosmos<T, 2>>(device, N, max_distfac);
+        case 3:
+            return make_unique<cosmos<T, 3>>(device, N, max_distfac);
+        case 4:
+            return make_unique<cosmos<T, 4>>(device, N, max_distfac);
+        default:
+            throw std::runtime_error("Unsupported multipole order " + to_string(order) + ", must be 1...4");
+    }
+}
+
+// Largest number of particles for which the estimated device memory fits into the budget.
+// 10% of the budget are kept free for the buffers that grow on demand.
+template<class T>
+Tsize_t max_particles(goopax_device device, Tdouble budget_mb, Tdouble max_distfac, Tuint order)
+{
+    auto estimate = [&](Tsize_t N) -> Tsize_t {
+        switch (order)
+        {
+            case 1:
+                return cosmos<T, 1>::estimate_memory(device, N, max_distfac);
+            case 2:
+                return cosmos<T, 2>::estimate_memory(device, N, max_distfac);
+            case 3:
+                return cosmos<T, 3>::estimate_memory(device, N, max_distfac);
+            case 4:
+                return cosmos<T, 4>::estimate_memory(device, N, max_distfac);
+            default:
+                throw std::runtime_error("Unsupported multipole order " + to_string(order) + ", must be 1...4");
+        }
+    };
+    const Tdouble budget = budget_mb * 1048576 * 0.9;
+    Tsize_t lo = 0;
+    Tsize_t hi = numeric_limits<Tuint>::max();
+    while (hi - lo > 1)
+    {
+        const Tsize_t mid = lo + (hi - lo) / 2;
+        if (estimate(mid) <= budget)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+    {
+        throw std::runtime_error("Memory budget of " + to_string(budget_mb) + " MB is too small");
+    }
+    return lo;
+}
+
+// Number of particles, taken from the restart file or the memory budget if given.
+Tsize_t num_particles(goopax_device device)
+{
+    if (!RESTART().empty())
+    {
+        return read_snapshot_header(RESTART()).num_particles;
+    }
+    if (MEMORY_BUDGET() > 0)
+    {
+        const Tsize_t N = max_particles<Tfloat>(device, MEMORY_BUDGET(), MAX_DISTFAC(), MULTIPOLE_ORDER());
+        cout << "Memory budget " << MEMORY_BUDGET() << " MB: using " << N << " particles" << endl;
+        return N;
+    }
+    return NUM_PARTICLES();
+}
+
+// Runs the simulation without window and renderer, e.g. on compute nodes.
+int run_headless(const char* ic_filename)
+{
+    vector<goopax_device> all_devices;
+    for (goopax_device d : goopax::devices(env_ALL))
+    {
+        all_devices.push_back(d);
+    }
+    if (all_devices.size() < NUM_DEVICES() || NUM_DEVICES() == 0)
+    {
+        throw std::runtime_error("Requested " + to_string(NUM_DEVICES()) + " devices, but "
+                                 + to_string(all_devices.size()) + " are available");
+    }
+    goopax_device device = (NUM_DEVICES() > 1 ? all_devices[0] : default_device(env_ALL));
+    cout << "Running headless on device " << device.name() << endl;
+    if (NUM_DEVICES() > 1)
+    {
+        cout << "Note: the helper devices share the force calculation. All particles must still fit on "
+             << device.name() << "." << endl;
+    }
+
+#if GOOPAX_DEBUG
+    // Increasing number of threads to be able to check for race conditions.
+    device.force_global_size(192);
+#endif
+
+    unique_ptr<cosmos_base<Tfloat>> Cosmos =
+        make_cosmos<Tfloat>(device, num_particles(device), MAX_DISTFAC(), MULTIPOLE_ORDER());
+    for (Tuint d = 1; d < NUM_DEVICES(); ++d)
+    {
+        cout << "Using helper device " << all_devices[d].name() << endl;
+        Cosmos->add_helper(all_devices[d]);
+    }
+    Cosmos->init_state(ic_filename);
+    Cosmos->print_memory_report();
+
+    if (PRECISION_TEST())
+    {
+        Cosmos->precision_test();
+        return 0;
+    }
+    if (NEIGHBOR_TEST())
+    {
+        Cosmos->neighbor_test();
+        return 0;
+    }
+
+    vector<Tdouble> steptimes;
+    steptimes.reserve(NUM_STEPS());
+    for (Tuint step = 0; step < NUM_STEPS(); ++step)
+    {
+        // Timing includes the device copies of a snapshot queued in the previous step, but not the file output.
+        device.wait_all();
+        auto t0 = steady_clock::now();
+        Cosmos->step();
+        device.wait_all();
+        auto t1 = steady_clock::now();
+
+        steptimes.push_back(duration<double>(t1 - t0).count());
+        cout << "step " << step << ": " << steptimes.back() * 1000 << " ms" << endl;
+
+        if (SNAPSHOT_INTERVAL() != 0 && Cosmos->step_count % SNAPSHOT_INTERVAL() == 0)
+        {
+            stringstream filename;
+            filename << SNAPSHOT_PREFIX() << "_" << setw(6) << setfill('0') << Cosmos->step_count << ".snap";
+            cout << "Writing snapshot " << filename.str() << endl;
+            Cosmos->write_snapshot(filename.str());
+        }
+        if (FOF_INTERVAL() != 0 && Cosmos->step_count % FOF_INTERVAL() == 0)
+        {
+            // Linking length in units of the mean particle spacing in the box, whose volume is 16 halflen^3.
+            const Tdouble b = FOF_LINKING_LENGTH() * cbrt(16 * pow3(Tdouble(halflen)) / Cosmos->x.size());
+            auto t2 = steady_clock::now();
+            vector<halo> halos = Cosmos->find_halos(b, FOF_MIN_MEMBERS());
+            stringstream filename;
+            filename << FOF_PREFIX() << "_" << setw(6) << setfill('0') << Cosmos->step_count << ".txt";
+            write_halo_catalogue(filename.str(), halos);
+            cout << "Found " << halos.size() << " halos in " << duration<double>(steady_clock::now() - t2).count()
+                 << " s, wrote " << filename.str() << endl;
+        }
+    }
+
+    if (!steptimes.empty())
+    {
+        Tdouble sum = 0;
+        for (Tdouble t : steptimes)
+        {
+            sum += t;
+        }
+        std::sort(steptimes.begin(), steptimes.end());
+        cout << "N=" << Cosmos->x.size() << ", steps=" << steptimes.size()
+             << ", time per step [ms]: mean=" << sum / steptimes.size() * 1000
+             << ", median=" << steptimes[steptimes.size() / 2] * 1000 << ", min=" << steptimes.front() * 1000
+             << ", max=" << steptimes.back() * 1000 << endl;
+        if (INCREMENTAL_SORT())
+        {
+            cout << "incremental sorts: " << Cosmos->Resort.num_incremental
+                 << ", full sorts: " << Cosmos->Resort.num_full << endl;
+        }
+        if (REFIT_INTERVAL() > 1)
+        {
+            cout << "tree refits: " << Cosmos->num_refits << ", rebuilds: " << Cosmos->num_rebuilds << endl;
+        }
+    }
+    Cosmos->writer.wait();
+    if (Timings.enabled)
+    {
+        Timings.write(TIMINGS(), TIMINGS_CHROME());
+    }
+    return 0;
+}
+
+/*
+  Searches for the fastest FMM parameters that meet the accuracy target TUNE_TARGET_ERROR.
+  Coordinate descent: Each parameter in turn is varied over its candidate values while the others are kept fixed.
+  Every candidate is timed and checked with precision_test. The best configuration is written to TUNE_OUTPUT,
+  together with the Pareto front of time versus error. Load it in later runs with --fmm_config.
+ */
+int run_tune(const char* ic_filename)
+{
+    goopax_device device = default_device(env_ALL);
+    cout << "Tuning on device " << device.name() << ", target error " << TUNE_TARGET_ERROR() << endl;
+
+    struct candidates
+    {
+        tunable_base& param;
+        vector<string> values;
+    };
+    vector<candidates> space = {
+        { MULTIPOLE_ORDER, { "1", "2", "3", "4" } },
+        { MAX_NODESIZE, { "4", "8", "16", "32", "64" } },
+        { LS_USE, { "16", "64", "256" } },
+        { MAX_BIGNODE_BITS, { "1", "2", "3", "4" } },
+        { MULTIPOLE_COSTFAC, { "40", "80", "160", "320", "640" } },
+        { MAX_DISTFAC, { "0.8", "1.0", "1.2", "1.5", "2.0" } },
+    };
+
+    struct result
+    {
+        map<string, string> config;
+        Tdouble time;
+        Tdouble err;
+    };
+    vector<result> results;
+
+    auto current_config = [&]() {
+        map<string, string> ret;
+        for (auto& c : space)
+        {
+            ret[c.param.name] = c.param.get_string();
+        }
+        return ret;
+    };
+
+    auto evaluate = [&]() -> const result* {
+        const auto config = current_config();
+        for (auto& r : results)
+        {
+            if (r.config == config)
+                return &r;
+        }
+        cout << "\nTrying";
+        for (auto& c : config)
+        {
+            cout << " " << c.first << "=" << c.second;
+        }
+        cout << endl;
+        try
+        {
+            unique_ptr<cosmos_base<Tfloat>> Cosmos =
+                make_cosmos<Tfloat>(device, num_particles(device), MAX_DISTFAC(), MULTIPOLE_ORDER());
+            Cosmos->init_state(ic_filename);
+            auto p = Cosmos->precision_test();
+            results.push_back({ config, p.time, p.force_err });
+            cout << "time=" << p.time * 1000 << " ms, error=" << p.force_err << endl;
+            return &results.back();
+        }
+        catch (const std::exception& e)
+        {
+            cout << "failed: " << e.what() << endl;
+            return nullptr;
+        }
+    };
+
+    // Feasible configurations are compared by time, infeasible ones by error.
+    auto better = [](const result& a, const result& b) {
+        const bool fa = (a.err <= TUNE_TARGET_ERROR());
+        const bool fb = (b.err <= TUNE_TARGET_ERROR());
+        if (fa != fb)
+            return fa;
+        return fa ? a.time < b.time : a.err < b.err;
+    };
+
+    const result* best_ptr = evaluate();
+    if (!best_ptr)
+    {
+        throw std::runtime_error("Initial configuration failed");
+    }
+    result best = *best_ptr;
+
+    for (Tuint round = 0; round < TUNE_ROUNDS(); ++round)
+    {
+        bool changed = false;
+        for (auto& c : space)
+        {
+            const string old_value = best.config.at(c.param.name);
+            string best_value = old_value;
+            for (const string& value : c.values)
+            {
+                if (value == old_value)
+                    continue;
+                c.param.set_string(value);
+                const result* r = evaluate();
+                if (r && better(*r, best))
+                {
+                    best = *r;
+                    best_value = value;
+                }
+            }
+            c.param.set_string(best_value);
+            changed = changed || (best_value != old_value);
+        }
+        if (!changed)
+            break;
+    }
+
+    ofstream out(TUNE_OUTPUT());
+    out << "# FMM parameters tuned on device " << device.name() << ", N=" << num_particles(device)
+        << ", target error=" << TUNE_TARGET_ERROR() << "\n";
+    out << "# time=" << best.time * 1000 << " ms, error=" << best.err << "\n";
+    out << "# Pareto front (time [ms], error, configuration):\n";
+    vector<result> sorted = results;
+    std::sort(sorted.begin(), sorted.end(), [](const result& a, const result& b) { return a.time < b.time; });
+    Tdouble min_err = numeric_limits<Tdouble>::infinity();
+    for (auto& r : sorted)
+    {
+        if (r.err < min_err)
+        {
+            min_err = r.err;
+            out << "#   " << r.time * 1000 << " " << r.err;
+            for (auto& c : r.config)
+            {
+                out << " " << c.first << "=" << c.second;
+            }
+            out << "\n";
+        }
+    }
+    for (auto& c : best.config)
+    {
+        out << c.first << "=" << c.second << "\n";
+    }
+    if (!out)
+    {
+        throw std::runtime_error("Failed to write " + TUNE_OUTPUT());
+    }
+    cout << "\nBest configuration written to " << TUNE_OUTPUT() << ": time=" << best.time * 1000
+         << " ms, error=" << best.err << endl;
+    if (best.err > TUNE_TARGET_ERROR())
+    {
+        cout << "Warning: target error not reached." << endl;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
+    // init_params removes the options it parsed. The config file must not override those.
+    const vector<string> args(argv + 1, argv + argc);
     init_params(argc, argv);
 
+    if (!FMM_CONFIG().empty())
+    {
+        tunable_base::read_config(FMM_CONFIG(), args);
+    }
+    Timings.enabled = !TIMINGS().empty();
+
+    if (TUNE())
+    {
+        return run_tune(argc >= 2 ? argv[1] : nullptr);
+    }
+
+    if (HEADLESS())
+    {
+        return run_headless(argc >= 2 ? argv[1] : nullptr);
+    }
+
     unique_ptr<sdl_window> window = sdl_window::create("fmm nbody",
                                                        { 1024, 768 },
                                                        SDL_WINDOW_RESIZABLE | SDL_WINDOW_HIGH_PIXEL_DENSITY,
                                                        static_cast<goopax::envmode>(env_ALL & ~env_VULKAN));
     goopax_device device = window->device;
+    const Tsize_t N = num_particles(device);
 
 #if GOOPAX_DEBUG
     // Increasing number of threads to be able to check for race conditions.
     device.force_global_size(192);
 #endif
 
+    unique_ptr<cosmos_base<Tfloat>> Cosmos = make_cosmos<Tfloat>(device, N, MAX_DISTFAC(), MULTIPOLE_ORDER());
+
+    // The renderer reads the positions directly from the simulation buffers, without copying.
 #if WITH_METAL
+    // Metal buffers are ordinary goopax buffers.
     particle_renderer Renderer(dynamic_cast<sdl_window_metal&>(*window));
-    buffer<Vector3<Tfloat>> x(device, NUM_PARTICLES()); // OpenGL buffer
-    buffer<Vector4<Tfloat>> color(device, NUM_PARTICLES());
 #elif WITH_OPENGL
-    opengl_buffer<Vector3<Tfloat>> x(device, NUM_PARTICLES()); // OpenGL buffer
-    opengl_buffer<Vector4<Tfloat>> color(device, NUM_PARTICLES());
-#else
-    buffer<Vector3<Tfloat>> x(device, NUM_PARTICLES());
-    buffer<Vector4<Tfloat>> color(device, NUM_PARTICLES());
+    opengl_buffer<Vector4<Tfloat>> color(device, N);
+    // One OpenGL buffer for each storage that can hold the positions.
+    vector<gl_buffer> x_gl;
+    vector<buffer<Vector3<Tfloat>>> x_storage;
+    for (Tuint k = 0; k < (LEAN_MEMORY() ? 3u : 2u); ++k)
+    {
+        x_gl.emplace_back(N * sizeof(Vector3<Tfloat>));
+        x_storage.push_back(buffer<Vector3<Tfloat>>::create_from_gl(device, x_gl.back().gl_id, BUFFER_READ_WRITE));
+    }
+    Cosmos->set_position_storage(std::move(x_storage));
 #endif
 
-    cosmos<Tfloat, MULTIPOLE_ORDER> Cosmos(device, NUM_PARTICLES(), MAX_DISTFAC());
+    Cosmos->init_state(argc >= 2 ? argv[1] : nullptr);
+    Cosmos->print_memory_report();
 
-    if (argc >= 2)
+    if (PRECISION_TEST())
     {
-        Cosmos.make_IC(argv[1]);
+        Cosmos->precision_test();
+        return 0;
     }
-
-    if (PRECISION_TEST())
+    if (NEIGHBOR_TEST())
     {
-        Cosmos.precision_test();
+        Cosmos->neighbor_test();
         return 0;
     }
 
-    kernel set_colors(device, [&](const resource<Vector<Tfloat, 3>>& cx) {
-        gpu_for_global(0, x.size(), [&](gpu_uint k) {
-            color[k] = ::color(Cosmos.potential[k]);
-            x[k] = cx[k];
-            // Tweaking z coordinate to use potential for depth testing.
-            // Particles are displayed according to their x and y coordinates.
-            // If multiple particles are drawn at the same pixel, the one with the
-            // highest potential will be shown.
-            x[k][2] = -Cosmos.potential[k] * 0.01f;
-        });
+#if WITH_OPENGL
+    // Only needed for the frames that are displayed.
+    kernel set_colors(device, [&](const resource<Tfloat>& potential) {
+        gpu_for_global(0, color.size(), [&](gpu_uint k) { color[k] = ::color(potential[k]); });
     });
+#endif
 
+    auto last_render = steady_clock::now();
     bool quit = false;
     while (!quit)
     {
@@ -2530,32 +4592,48 @@ int main(int argc, char** argv)
 
         static auto frametime = steady_clock::now();
         static Tint framecount = 0;
+        static Tint stepcount = 0;
 
-        Cosmos.step();
+        for (Tuint s = 0; s < STEPS_PER_FRAME(); ++s)
+        {
+            Cosmos->step();
+        }
+        stepcount += STEPS_PER_FRAME();
 
         auto now = steady_clock::now();
-        ++framecount;
         if (now - frametime > chrono::seconds(1))
         {
             stringstream title;
-            Tdouble rate = framecount / chrono::duration<double>(now - frametime).count();
-            title << "N-body. N=" << x.size() << ", " << rate << " fps, device=" << device.name();
+            const Tdouble seconds = chrono::duration<double>(now - frametime).count();
+            title << "N-body. N=" << N << ", " << stepcount / seconds << " steps/s, " << framecount / seconds
+                  << " fps, device=" << device.name();
             string s = title.str();
             SDL_SetWindowTitle(window->window, s.c_str());
             framecount = 0;
+            stepcount = 0;
             frametime = now;
         }
 
-        set_colors(Cosmos.x);
-
+        // Rendering is skipped if the display cannot keep up, so that the simulation does not wait for it.
+        if (now - last_render >= chrono::duration<double>(1.0 / MAX_FPS()))
+        {
+            last_render = now;
+            ++framecount;
 #if WITH_METAL
-        Renderer.render(x);
+            Renderer.render(Cosmos->x);
 #elif WITH_OPENGL
-        render(window->window, x, &color);
-        SDL_GL_SwapWindow(window->window);
+            set_colors(Cosmos->potential);
+            render(window->window, device, x_gl[Cosmos->storage[0]].gl_id, N, &color, halflen);
+            SDL_GL_SwapWindow(window->window);
 #else
-        cout << "x=" << x << endl;
+            cout << "x=" << Cosmos->x << endl;
 #endif
+        }
+    }
+    if (Timings.enabled)
+    {
+        device.wait_all();
+        Timings.write(TIMINGS(), TIMINGS_CHROME());
     }
     return 0;
 }
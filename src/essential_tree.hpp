@@ -0,0 +1,438 @@
+/*
+  Locally essential tree: the part of the tree and of the particles that the downwards kernel needs to calculate the
+  forces of the particle range [a, b), i.e. of a contiguous signature range.
+
+  The downwards kernel only reads the nodes in the vicinity grids around the nodes of the range, and the particles of
+  the leaves in these grids and of the direct summation partners. The grids extend over grid_cells vicinity cells,
+  and the direct summation over local_cells cells. At tree depth d, a vicinity cell is a node of depth d - cell_offset.
+  The levels are marked from the top:
+  - A node is needed if it overlaps with the range, or if it is close enough to a particle of the range to be part of
+    one of its vicinity grids. Distances are measured from the first particle of the node, with the cell diagonal and
+    the refit drift added as margins.
+  - The children of needed nodes are included, as are the top levels. Included nodes that are not needed become
+    leaves. The downwards kernel never splits them.
+  - The particles of needed leaves are included. On the level p2p_depth, the particles of all nodes within the direct
+    summation radius are included as well. The receiving device must not do direct summation above that level.
+  The included nodes and particles are compacted in their original order, so children stay in pairs, the top levels
+  keep their indices, and the particles of the range stay contiguous.
+ */
+template<class T, class node_t>
+struct essential_tree
+{
+    using gpu_T = typename make_gpu<T>::type;
+
+    const tree_grid<T> grid;
+    const goopax_device device;
+    const Tuint ls_use;
+    const Tuint gs_use;
+    const Tuint ng_use = gs_use / ls_use;
+    const Tuint grid_cells;
+    const Tuint local_cells;
+    const Tuint cell_offset;
+
+    struct result
+    {
+        Tuint num_nodes;
+        Tuint num_particles;
+        Tuint first_particle; // New position of particle a.
+    };
+
+    buffer<CTuint> node_flags; // 1: included, 2: needed.
+    buffer<CTuint> node_index;
+    buffer<CTuint> particle_flags; // 1: included. One more entry than particles, so that pend can be mapped.
+    buffer<CTuint> particle_index;
+    buffer<CTuint> group_offsets;
+    buffer<CTuint> status; // [0]: number of nodes, [1]: number of particles, [2]: new position of particle a.
+
+    // The essential tree. The buffers grow on demand, only the leading entries are valid.
+    buffer<node_t> tree;
+    buffer<Vector<T, 3>> x;
+    buffer<T> mass;
+    buffer<pair<signature_t, CTuint>> plist;
+    buffer<CTuint> timebin;
+    buffer<Vector<T, 3>> acc;
+    buffer<T> potential;
+
+    kernel<void(buffer<CTuint>& node_flags, Tuint size, Tuint top_end)> initfunc;
+
+    kernel<void(const buffer<node_t>& tree,
+                const buffer<Vector<T, 3>>& x,
+                buffer<CTuint>& node_flags,
+                buffer<CTuint>& particle_flags,
+                Tuint root,
+                Tuint begin,
+                Tuint end,
+                Tuint a,
+                Tuint b,
+                T radius,
+                Tuint grid_depth,
+                T p2p_radius,
+                Tuint p2p_grid_depth,
+                Tuint p2p_level)>
+        markfunc;
+
+    kernel<void(const buffer<CTuint>& flags, Tuint size, buffer<CTuint>& group_offsets)> countfunc;
+
+    kernel<void(buffer<CTuint>& group_offsets, buffer<CTuint>& status, Tuint slot)> scanfunc;
+
+    kernel<void(const buffer<CTuint>& flags, Tuint size, const buffer<CTuint>& group_offsets, buffer<CTuint>& index)>
+        indexfunc;
+
+    kernel<void(const buffer<node_t>& src,
+                const buffer<CTuint>& node_flags,
+                const buffer<CTuint>& node_index,
+                const buffer<CTuint>& particle_index,
+                Tuint size,
+                buffer<node_t>& dest)>
+        gathernodes;
+
+    kernel<void(const buffer<Vector<T, 3>>& x,
+                const buffer<T>& mass,
+                const buffer<pair<signature_t, CTuint>>& plist,
+                const buffer<CTuint>& timebin,
+                const buffer<Vector<T, 3>>& acc,
+                const buffer<T>& potential,
+                const buffer<CTuint>& particle_flags,
+                const buffer<CTuint>& particle_index,
+                Tuint size,
+                Tuint a,
+                buffer<Vector<T, 3>>& dest_x,
+                buffer<T>& dest_mass,
+                buffer<pair<signature_t, CTuint>>& dest_plist,
+                buffer<CTuint>& dest_timebin,
+                buffer<Vector<T, 3>>& dest_acc,
+                buffer<T>& dest_potential,
+                buffer<CTuint>& status)>
+        gatherparticles;
+
+    // Contiguous chunk of the list that is handled by the current work group.
+    static pair<gpu_uint, gpu_uint> group_chunk(gpu_uint size)
+    {
+        const gpu_uint chunk = intceil_gpu((size + num_groups() - 1) / num_groups(), local_size());
+        return { min(group_id() * chunk, size), min((group_id() + 1) * chunk, size) };
+    }
+
+    static gpu_uint intceil_gpu(gpu_uint a, gpu_uint mod)
+    {
+        return (a + mod - 1) / mod * mod;
+    }
+
+    template<class B>
+    void reserve(B& buf, Tuint size)
+    {
+        if (buf.size() < size)
+        {
+            buf.assign(device, size + size / 4);
+        }
+    }
+
+    // Exclusive scan of the flags into index. The total goes to status[slot].
+    void scan(const buffer<CTuint>& flags, Tuint size, buffer<CTuint>& index, Tuint slot)
+    {
+        countfunc(flags, size, group_offsets);
+        scanfunc(group_offsets, status, slot);
+        indexfunc(flags, size, group_offsets, index);
+    }
+
+    /*
+      Extracts the essential tree of the particle range [a, b) from tree and the particles, which must be those of the
+      last tree build. levels holds the node range of each tree level. The nodes below top_end must be the full top
+      levels. margin is added to all distances. If potentials are not calculated, any buffer of the particle count can
+      be passed as full_potential.
+     */
+    result operator()(const buffer<node_t>& full_tree,
+                      const buffer<Vector<T, 3>>& full_x,
+                      const buffer<T>& full_mass,
+                      const buffer<pair<signature_t, CTuint>>& full_plist,
+                      const buffer<CTuint>& full_timebin,
+                      const buffer<Vector<T, 3>>& full_acc,
+                      const buffer<T>& full_potential,
+                      Tuint root,
+                      const vector<pair<Tuint, Tuint>>& levels,
+                      Tuint a,
+                      Tuint b,
+                      Tuint top_end,
+                      Tuint p2p_depth,
+                      Tdouble margin)
+    {
+        const Tuint N = full_plist.size();
+        const Tuint tree_size = levels.back().second;
+        const Tuint max_depth = levels.size() - 1;
+        reserve(node_flags, tree_size);
+        reserve(node_index, tree_size);
+        reserve(particle_flags, N + 1);
+        reserve(particle_index, N + 1);
+
+        initfunc(node_flags, tree_size, top_end);
+        particle_flags.fill(0);
+        for (Tuint d = 0; d < levels.size(); ++d)
+        {
+            const Vector<Tdouble, 3> cell = grid.cell_extent(d > cell_offset ? d - cell_offset : 0);
+            const Tdouble longest = max(max(cell[0], cell[1]), cell[2]);
+            const Tdouble diagonal = sqrt(grid.cell_extent(d).squaredNorm());
+            const Tdouble radius = (grid_cells + 1) * longest + diagonal + margin;
+            const Tdouble p2p_radius = (local_cells + 1) * longest + diagonal + margin;
+            markfunc(full_tree,
+                     full_x,
+                     node_flags,
+                     particle_flags,
+                     root,
+                     levels[d].first,
+                     levels[d].second,
+                     a,
+                     b,
+                     radius,
+                     grid.depth_for(radius, max_depth),
+                     p2p_radius,
+                     grid.depth_for(p2p_radius, max_depth),
+                     d == p2p_depth);
+        }
+        scan(node_flags, tree_size, node_index, 0);
+        scan(particle_flags, N + 1, particle_index, 1);
+
+        array<CTuint, 3> st;
+        status.copy_to_host(st.data());
+        reserve(tree, st[0]);
+        reserve(x, st[1]);
+        reserve(mass, st[1]);
+        reserve(plist, st[1]);
+        reserve(timebin, st[1]);
+        reserve(acc, st[1]);
+        reserve(potential, st[1]);
+
+        gathernodes(full_tree, node_flags, node_index, particle_index, tree_size, tree);
+        gatherparticles(full_x,
+                        full_mass,
+                        full_plist,
+                        full_timebin,
+                        full_acc,
+                        full_potential,
+                        particle_flags,
+                        particle_index,
+                        N,
+                        a,
+                        x,
+                        mass,
+                        plist,
+                        timebin,
+                        acc,
+                        potential,
+                        status);
+        status.copy_to_host(st.data());
+        cout1 << "essential tree of [" << a << "," << b << "): nodes=" << st[0] << "/" << tree_size
+              << ", particles=" << st[1] << "/" << N << endl;
+        return { st[0], st[1], st[2] };
+    }
+
+    // Device memory of the buffers, in bytes.
+    Tsize_t memory_usage() const
+    {
+        return (node_flags.size() + node_index.size() + particle_flags.size() + particle_index.size()
+                + group_offsets.size() + status.size() + timebin.size())
+                   * sizeof(CTuint)
+               + tree.size() * sizeof(node_t) + (x.size() + acc.size()) * sizeof(Vector<T, 3>)
+               + (mass.size() + potential.size()) * sizeof(T) + plist.size() * sizeof(pair<signature_t, CTuint>);
+    }
+
+    essential_tree(
+        goopax_device device0, Tdouble halflen, Tuint grid_cells0, Tuint local_cells0, Tuint cell_offset0)
+        : grid(halflen)
+        , device(device0)
+        , ls_use(device.default_local_size())
+        , gs_use(device.default_global_size_min())
+        , grid_cells(grid_cells0)
+        , local_cells(local_cells0)
+        , cell_offset(cell_offset0)
+        , group_offsets(device, ng_use)
+        , status(device, 3)
+    {
+        initfunc.assign(device, [](resource<CTuint>& node_flags, gpu_uint size, gpu_uint top_end) {
+            gpu_for_global(0, size, [&](gpu_uint n) { node_flags[n] = cond(n < top_end, 1u, 0u); });
+        });
+
+        markfunc.assign(device,
+                        [this](const resource<node_t>& tree,
+                               const resource<Vector<T, 3>>& x,
+                               resource<CTuint>& node_flags,
+                               resource<CTuint>& particle_flags,
+                               gpu_uint root,
+                               gpu_uint begin,
+                               gpu_uint end,
+                               gpu_uint a,
+                               gpu_uint b,
+                               gpu_T radius,
+                               gpu_uint grid_depth,
+                               gpu_T p2p_radius,
+                               gpu_uint p2p_grid_depth,
+                               gpu_uint p2p_level) {
+                            gpu_for_global(begin, end, [&](gpu_uint n) {
+                                const gpu_uint flags = node_flags[n];
+                                gpu_if((flags & 1) != 0)
+                                {
+                                    const gpu_uint pbegin = tree[n].pbegin;
+                                    const gpu_uint pend = tree[n].pend;
+                                    const gpu_uint first_child = tree[n].first_child;
+
+                                    // Whether a particle of the range is within the radius of the node.
+                                    auto near = [&](gpu_uint depth, gpu_T r) {
+                                        const Vector<gpu_T, 3> xn = x[pbegin];
+                                        gpu_bool found = false;
+                                        grid.for_each_neighbor_cell(
+                                            tree, root, depth, xn, r * r, [&](gpu_uint cbegin, gpu_uint cend) {
+                                                found = found || (cbegin < b && cend > a);
+                                            });
+                                        return found;
+                                    };
+
+                                    const gpu_bool own = (pbegin < b && pend > a);
+                                    gpu_bool need = own;
+                                    gpu_bool p2p = own && p2p_level != 0;
+                                    gpu_if(!own && pend > pbegin)
+                                    {
+                                        need = near(grid_depth, radius);
+                                        gpu_if(need && p2p_level != 0)
+                                        {
+                                            p2p = near(p2p_grid_depth, p2p_radius);
+                                        }
+                                    }
+                                    gpu_if((need && first_child == 0) || p2p)
+                                    {
+                                        gpu_for(pbegin, pend, [&](gpu_uint p) { particle_flags[p] = 1; });
+                                    }
+                                    gpu_if(need && first_child != 0)
+                                    {
+                                        node_flags[first_child] = 1;
+                                        node_flags[first_child + 1] = 1;
+                                    }
+                                    node_flags[n] = flags | cond(need, 2u, 0u);
+                                }
+                            });
+                        });
+
+        countfunc.assign(
+            device,
+            [](const resource<CTuint>& flags, gpu_uint size, resource<CTuint>& group_offsets) {
+                const auto [begin, end] = group_chunk(size);
+                gpu_uint count = 0;
+                gpu_for(begin, end, local_size(), [&](gpu_uint base) {
+                    const gpu_uint k = base + local_id();
+                    count += gpu_uint(k < end && (flags[min(k, size - 1)] & 1) != 0);
+                });
+                count = work_group_reduce_add(count, local_size());
+                gpu_if(local_id() == 0)
+                {
+                    group_offsets[group_id()] = count;
+                }
+            },
+            ls_use,
+            gs_use);
+
+        // Exclusive scan over the group counts. Runs in a single work group.
+        scanfunc.assign(
+            device,
+            [](resource<CTuint>& group_offsets, resource<CTuint>& status, gpu_uint slot) {
+                const gpu_uint num = group_offsets.size();
+                gpu_uint sum = 0;
+                gpu_for(0, intceil_gpu(num, local_size()), local_size(), [&](gpu_uint base) {
+                    const gpu_uint t = base + local_id();
+                    gpu_uint val = 0;
+                    gpu_if(t < num)
+                    {
+                        val = group_offsets[t];
+                    }
+                    const gpu_uint val_offset = work_group_scan_exclusive_add(val, local_size());
+                    gpu_if(t < num)
+                    {
+                        group_offsets[t] = sum + val_offset;
+                    }
+                    sum += shuffle(val_offset + val, local_size() - 1, local_size());
+                });
+                gpu_if(local_id() == 0)
+                {
+                    status[slot] = sum;
+                }
+            },
+            ls_use,
+            ls_use);
+
+        indexfunc.assign(
+            device,
+            [](const resource<CTuint>& flags,
+               gpu_uint size,
+               const resource<CTuint>& group_offsets,
+               resource<CTuint>& index) {
+                const auto [begin, end] = group_chunk(size);
+                gpu_uint pos = group_offsets[group_id()];
+                gpu_for(begin, end, local_size(), [&](gpu_uint base) {
+                    const gpu_uint k = base + local_id();
+                    const gpu_bool valid = (k < end);
+                    const gpu_bool included = valid && (flags[min(k, size - 1)] & 1) != 0;
+                    const gpu_uint offset = work_group_scan_exclusive_add(gpu_uint(included), local_size());
+                    gpu_if(valid)
+                    {
+                        index[k] = pos + offset;
+                    }
+                    pos += shuffle(offset + gpu_uint(included), local_size() - 1, local_size());
+                });
+            },
+            ls_use,
+            gs_use);
+
+        gathernodes.assign(device,
+                           [](const resource<node_t>& src,
+                              const resource<CTuint>& node_flags,
+                              const resource<CTuint>& node_index,
+                              const resource<CTuint>& particle_index,
+                              gpu_uint size,
+                              resource<node_t>& dest) {
+                               gpu_for_global(0, size, [&](gpu_uint n) {
+                                   const gpu_uint flags = node_flags[n];
+                                   gpu_if((flags & 1) != 0)
+                                   {
+                                       const gpu_uint j = node_index[n];
+                                       dest[j].first_child =
+                                           cond((flags & 2) != 0, node_index[src[n].first_child], 0u);
+                                       dest[j].pbegin = particle_index[src[n].pbegin];
+                                       dest[j].pend = particle_index[src[n].pend];
+                                       dest[j].Mr = src[n].Mr;
+                                   }
+                               });
+                           });
+
+        gatherparticles.assign(device,
+                               [](const resource<Vector<T, 3>>& x,
+                                  const resource<T>& mass,
+                                  const resource<pair<signature_t, CTuint>>& plist,
+                                  const resource<CTuint>& timebin,
+                                  const resource<Vector<T, 3>>& acc,
+                                  const resource<T>& potential,
+                                  const resource<CTuint>& particle_flags,
+                                  const resource<CTuint>& particle_index,
+                                  gpu_uint size,
+                                  gpu_uint a,
+                                  resource<Vector<T, 3>>& dest_x,
+                                  resource<T>& dest_mass,
+                                  resource<pair<signature_t, CTuint>>& dest_plist,
+                                  resource<CTuint>& dest_timebin,
+                                  resource<Vector<T, 3>>& dest_acc,
+                                  resource<T>& dest_potential,
+                                  resource<CTuint>& status) {
+                                   gpu_for_global(0, size, [&](gpu_uint p) {
+                                       gpu_if(particle_flags[p] != 0)
+                                       {
+                                           const gpu_uint j = particle_index[p];
+                                           dest_x[j] = x[p];
+                                           dest_mass[j] = mass[p];
+                                           dest_plist[j] = plist[p];
+                                           dest_timebin[j] = timebin[p];
+                                           dest_acc[j] = acc[p];
+                                           dest_potential[j] = potential[p];
+                                       }
+                                   });
+                                   gpu_if(global_id() == 0)
+                                   {
+                                       status[2] = particle_index[a];
+                                   }
+                               });
+    }
+};
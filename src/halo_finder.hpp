@@ -0,0 +1,199 @@
+/*
+  Friends-of-friends group finder on the device.
+
+  Two particles are friends if their distance is below the linking length b. The groups are the connected components
+  of this relation. The particles must be in the order of the last tree build, i.e. sorted by signature.
+
+  Neighbor search: The deepest tree level whose cells are at least b wide serves as a grid (see tree_grid).
+  For each particle, the particles in the ranges [pbegin, pend) of the 27 surrounding cells are checked.
+
+  Union-find: Each particle starts as its own root. A pass hooks the larger root below the smaller one for every pair of
+  friends with different roots, followed by pointer jumping. Concurrent hooks can overwrite each other, so passes are
+  repeated until a pass finds nothing left to link.
+ */
+
+#include <map>
+
+struct halo
+{
+    Tuint id;                    // Smallest particle index of the group, in the sorted order of the finder run
+    Tuint members;               // Number of particles
+    Tdouble mass;                // Total mass
+    Vector<Tdouble, 3> center;   // Center of mass
+    Vector<Tdouble, 3> velocity; // Center of mass velocity
+    Tdouble radius;              // Mass-weighted rms distance from the center
+};
+
+// Writes one line per halo.
+void write_halo_catalogue(const string& filename, const vector<halo>& halos)
+{
+    ofstream out(filename);
+    out << "# id members mass x y z vx vy vz radius" << endl;
+    for (const halo& h : halos)
+    {
+        out << h.id << " " << h.members << " " << h.mass << " " << h.center[0] << " " << h.center[1] << " "
+            << h.center[2] << " " << h.velocity[0] << " " << h.velocity[1] << " " << h.velocity[2] << " "
+            << h.radius << endl;
+    }
+    if (!out)
+    {
+        throw std::runtime_error("Failed to write " + filename);
+    }
+}
+
+template<class T, class node_t>
+struct halo_finder
+{
+    using gpu_T = typename make_gpu<T>::type;
+
+    const tree_grid<T> grid;
+    buffer<CTuint> parent;
+    Tuint num_passes = 0; // Number of union-find passes of the last run
+
+    kernel<void(buffer<CTuint>& parent)> initfunc;
+
+    kernel<void(const buffer<node_t>& tree,
+                const buffer<Vector<T, 3>>& x,
+                buffer<CTuint>& parent,
+                Tuint root,
+                Tuint depth,
+                T b,
+                goopax_future<Tuint>& links)>
+        linkfunc;
+
+    kernel<void(buffer<CTuint>& parent)> compressfunc;
+
+    // Root of the group of particle a.
+    static gpu_uint find_root(const resource<CTuint>& parent, gpu_uint a)
+    {
+        gpu_while(parent[a] != a)
+        {
+            a = parent[a];
+        }
+        return a;
+    }
+
+    /*
+      Finds the groups of the particles x with linking length b, using the tree nodes from the root at position root.
+      Returns the groups with at least min_members particles, ordered by id.
+     */
+    vector<halo> operator()(const buffer<node_t>& tree,
+                            Tuint root,
+                            Tuint max_depth,
+                            const buffer<Vector<T, 3>>& x,
+                            const buffer<Vector<T, 3>>& v,
+                            const buffer<T>& mass,
+                            Tdouble b,
+                            Tuint min_members)
+    {
+        const Tsize_t N = x.size();
+        if (parent.size() != N)
+        {
+            parent.assign(x.get_device(), N);
+        }
+        const Tuint depth = grid.depth_for(b, max_depth);
+
+        initfunc(parent);
+        num_passes = 0;
+        while (true)
+        {
+            goopax_future<Tuint> links;
+            linkfunc(tree, x, parent, root, depth, b, links);
+            compressfunc(parent);
+            ++num_passes;
+            if (links.get() == 0)
+                break;
+        }
+
+        // Catalogue. The group members are scattered over the sorted order, so this is done on the host.
+        vector<CTuint> host_parent(N);
+        vector<Vector<T, 3>> host_x(N);
+        vector<Vector<T, 3>> host_v(N);
+        vector<T> host_mass(N);
+        parent.copy_to_host(host_parent.data());
+        x.copy_to_host(host_x.data());
+        v.copy_to_host(host_v.data());
+        mass.copy_to_host(host_mass.data());
+
+        vector<Tuint> members(N, 0);
+        for (Tsize_t k = 0; k < N; ++k)
+        {
+            ++members[host_parent[k]];
+        }
+        map<Tuint, halo> halos;
+        for (Tsize_t k = 0; k < N; ++k)
+        {
+            const Tuint r = host_parent[k];
+            if (members[r] < min_members)
+                continue;
+            halo& h = halos.try_emplace(r, halo{ r, members[r], 0, { 0, 0, 0 }, { 0, 0, 0 }, 0 }).first->second;
+            h.mass += host_mass[k];
+            h.center += host_mass[k] * host_x[k].template cast<Tdouble>();
+            h.velocity += host_mass[k] * host_v[k].template cast<Tdouble>();
+        }
+        for (auto& [r, h] : halos)
+        {
+            h.center /= h.mass;
+            h.velocity /= h.mass;
+        }
+        for (Tsize_t k = 0; k < N; ++k)
+        {
+            auto it = halos.find(host_parent[k]);
+            if (it != halos.end())
+            {
+                halo& h = it->second;
+                h.radius += host_mass[k] * (host_x[k].template cast<Tdouble>() - h.center).squaredNorm();
+            }
+        }
+        vector<halo> ret;
+        for (auto& [r, h] : halos)
+        {
+            h.radius = sqrt(h.radius / h.mass);
+            ret.push_back(h);
+        }
+        return ret;
+    }
+
+    halo_finder(goopax_device device, Tdouble halflen)
+        : grid(halflen)
+    {
+        initfunc.assign(device, [](resource<CTuint>& parent) {
+            gpu_for_global(0, parent.size(), [&](gpu_uint k) { parent[k] = k; });
+        });
+
+        linkfunc.assign(device,
+                        [this](const resource<node_t>& tree,
+                               const resource<Vector<T, 3>>& x,
+                               resource<CTuint>& parent,
+                               gpu_uint root,
+                               gpu_uint depth,
+                               gpu_T b,
+                               gather_add<Tuint>& links) {
+                            links = 0;
+                            const gpu_T b2 = b * b;
+                            gpu_for_global(0, x.size(), [&](gpu_uint i) {
+                                const Vector<gpu_T, 3> xi = x[i];
+                                auto link = [&](gpu_uint pbegin, gpu_uint pend) {
+                                    // Each pair is handled by its smaller index.
+                                    gpu_for(max(pbegin, i + 1), pend, [&](gpu_uint j) {
+                                        gpu_if((Vector<gpu_T, 3>(x[j]) - xi).squaredNorm() < b2)
+                                        {
+                                            const gpu_uint ri = find_root(parent, i);
+                                            const gpu_uint rj = find_root(parent, j);
+                                            gpu_if(ri != rj)
+                                            {
+                                                atomic_min(parent[max(ri, rj)], min(ri, rj), memory_order_relaxed);
+                                                links += 1;
+                                            }
+                                        }
+                                    });
+                                };
+                                grid.for_each_neighbor_cell(tree, root, depth, xi, b2, link);
+                            });
+                        });
+
+        compressfunc.assign(device, [](resource<CTuint>& parent) {
+            gpu_for_global(0, parent.size(), [&](gpu_uint k) { parent[k] = find_root(parent, k); });
+        });
+    }
+};
@@ -0,0 +1,263 @@
+/*
+  Incremental re-sort of a particle list that was sorted in the previous step.
+
+  Between time steps, most particles stay in their cell, so the list is almost sorted.
+  An element is considered displaced if it is out of order with respect to one of its neighbors.
+  The displaced elements are extracted by an order-preserving compaction, sorted by the radix sort,
+  and merged back into the remaining elements by binary search.
+  If too many elements are displaced, or if the remaining elements are not sorted, the full radix sort is used.
+  Only the key bits from min_bit upwards are compared, as in radix_sort.
+ */
+template<class key_t>
+struct incremental_sort
+{
+    using gpu_key_t = typename make_gpu<key_t>::type;
+
+    const Tuint ls_use;
+    const Tuint gs_use;
+    const Tuint ng_use = gs_use / ls_use;
+    const Tdouble max_fraction;
+
+    buffer<CTuint> group_offsets;
+    buffer<CTuint> status; // [0]: number of displaced elements, [1]: number of unsorted pairs in the kept list.
+    buffer<pair<key_t, CTuint>> displaced1;
+    buffer<pair<key_t, CTuint>> displaced2;
+
+    Tsize_t num_full = 0;
+    Tsize_t num_incremental = 0;
+
+    kernel<void(const buffer<pair<key_t, CTuint>>& plist, Tuint size, Tuint min_bit, buffer<CTuint>& group_offsets)>
+        countfunc;
+
+    kernel<void(buffer<CTuint>& group_offsets, buffer<CTuint>& status)> scanfunc;
+
+    kernel<void(const buffer<pair<key_t, CTuint>>& plist,
+                Tuint size,
+                Tuint min_bit,
+                const buffer<CTuint>& group_offsets,
+                buffer<pair<key_t, CTuint>>& kept,
+                buffer<pair<key_t, CTuint>>& displaced,
+                Tuint displaced_capacity)>
+        scatterfunc;
+
+    kernel<void(const buffer<pair<key_t, CTuint>>& kept, Tuint size, Tuint min_bit, buffer<CTuint>& status)> checkfunc;
+
+    kernel<void(const buffer<pair<key_t, CTuint>>& kept,
+                Tuint num_kept,
+                const buffer<pair<key_t, CTuint>>& displaced,
+                Tuint num_displaced,
+                Tuint min_bit,
+                buffer<pair<key_t, CTuint>>& dest)>
+        mergefunc;
+
+    static gpu_bool
+    is_displaced(const resource<pair<key_t, CTuint>>& plist, gpu_uint k, gpu_uint size, gpu_uint min_bit)
+    {
+        const gpu_key_t key = plist[k].first >> min_bit;
+        return (gpu_key_t(plist[cond(k == 0, k, k - 1)].first >> min_bit) > key)
+               || (key > gpu_key_t(plist[min(k + 1, size - 1)].first >> min_bit));
+    }
+
+    // Contiguous chunk of the list that is handled by the current work group.
+    static pair<gpu_uint, gpu_uint> group_chunk(gpu_uint size)
+    {
+        const gpu_uint chunk = intceil_gpu((size + num_groups() - 1) / num_groups(), local_size());
+        return { min(group_id() * chunk, size), min((group_id() + 1) * chunk, size) };
+    }
+
+    static gpu_uint intceil_gpu(gpu_uint a, gpu_uint mod)
+    {
+        return (a + mod - 1) / mod * mod;
+    }
+
+    // Binary search: Number of elements in list[0..size) with key < value (or <= value, if upper is true).
+    // The keys are compared from min_bit upwards, value must already be shifted.
+    static gpu_uint count_below(
+        const resource<pair<key_t, CTuint>>& list, gpu_uint size, gpu_key_t value, bool upper, gpu_uint min_bit)
+    {
+        gpu_uint begin = 0;
+        gpu_uint end = size;
+        gpu_while(begin < end)
+        {
+            const gpu_uint mid = (begin + end) / 2;
+            const gpu_key_t m = list[mid].first >> min_bit;
+            const gpu_bool below = (upper ? (m <= value) : (m < value));
+            begin = cond(below, mid + 1, begin);
+            end = cond(below, end, mid);
+        }
+        return begin;
+    }
+
+    // Sorts plist1. Uses plist2 as temporary storage.
+    // Assumes that the order of plist1 is the order of the previous step, i.e. plist1[k].second == k.
+    void operator()(radix_sort<key_t>& Radix,
+                    buffer<pair<key_t, CTuint>>& plist1,
+                    buffer<pair<key_t, CTuint>>& plist2,
+                    const Tuint max_depthbits,
+                    const Tuint min_bit = 0)
+    {
+        const Tuint size = plist1.size();
+        const Tuint capacity = displaced1.size();
+
+        countfunc(plist1, size, min_bit, group_offsets);
+        scanfunc(group_offsets, status);
+        scatterfunc(plist1, size, min_bit, group_offsets, plist2, displaced1, capacity);
+        Timings.mark("sort_select", checkfunc(plist2, size, min_bit, status));
+
+        array<CTuint, 2> st;
+        status.copy_to_host(st.data());
+        Timings.restart();
+        const Tuint num_displaced = st[0];
+        cout1 << "incremental sort: displaced=" << num_displaced << ", unsorted=" << st[1] << endl;
+
+        if (num_displaced > capacity || st[1] != 0)
+        {
+            ++num_full;
+            Radix(plist1, plist2, max_depthbits, size, min_bit);
+            return;
+        }
+
+        ++num_incremental;
+        if (num_displaced > 1)
+        {
+            Radix(displaced1, displaced2, max_depthbits, num_displaced, min_bit);
+        }
+        Timings.mark("sort_merge",
+                     mergefunc(plist2, size - num_displaced, displaced1, num_displaced, min_bit, plist1));
+    }
+
+    // Device memory of the scratch buffers, in bytes.
+    Tsize_t memory_usage() const
+    {
+        return (group_offsets.size() + status.size()) * sizeof(CTuint)
+               + (displaced1.size() + displaced2.size()) * sizeof(pair<key_t, CTuint>);
+    }
+
+    incremental_sort(goopax_device device, Tsize_t N, Tdouble max_fraction0)
+        : ls_use(device.default_local_size())
+        , gs_use(device.default_global_size_min())
+        , max_fraction(max_fraction0)
+        , group_offsets(device, ng_use)
+        , status(device, 2)
+        , displaced1(device, max(Tsize_t(N * max_fraction), Tsize_t(1)))
+        , displaced2(device, displaced1.size())
+    {
+        countfunc.assign(
+            device,
+            [](const resource<pair<key_t, CTuint>>& plist,
+               gpu_uint size,
+               gpu_uint min_bit,
+               resource<CTuint>& group_offsets) {
+                const auto [begin, end] = group_chunk(size);
+                gpu_uint count = 0;
+                gpu_for(begin, end, local_size(), [&](gpu_uint base) {
+                    const gpu_uint k = base + local_id();
+                    count += gpu_uint(k < end && is_displaced(plist, min(k, size - 1), size, min_bit));
+                });
+                count = work_group_reduce_add(count, local_size());
+                gpu_if(local_id() == 0)
+                {
+                    group_offsets[group_id()] = count;
+                }
+            },
+            ls_use,
+            gs_use);
+
+        // Exclusive scan over the group counts. Runs in a single work group.
+        scanfunc.assign(
+            device,
+            [](resource<CTuint>& group_offsets, resource<CTuint>& status) {
+                const gpu_uint num = group_offsets.size();
+                gpu_uint sum = 0;
+                gpu_for(0, intceil_gpu(num, local_size()), local_size(), [&](gpu_uint base) {
+                    const gpu_uint t = base + local_id();
+                    gpu_uint val = 0;
+                    gpu_if(t < num)
+                    {
+                        val = group_offsets[t];
+                    }
+                    const gpu_uint val_offset = work_group_scan_exclusive_add(val, local_size());
+                    gpu_if(t < num)
+                    {
+                        group_offsets[t] = sum + val_offset;
+                    }
+                    sum += shuffle(val_offset + val, local_size() - 1, local_size());
+                });
+                gpu_if(local_id() == 0)
+                {
+                    status[0] = sum;
+                    status[1] = 0;
+                }
+            },
+            ls_use,
+            ls_use);
+
+        scatterfunc.assign(
+            device,
+            [](const resource<pair<key_t, CTuint>>& plist,
+               gpu_uint size,
+               gpu_uint min_bit,
+               const resource<CTuint>& group_offsets,
+               resource<pair<key_t, CTuint>>& kept,
+               resource<pair<key_t, CTuint>>& displaced,
+               gpu_uint displaced_capacity) {
+                const auto [begin, end] = group_chunk(size);
+                gpu_uint displaced_pos = group_offsets[group_id()];
+                gpu_for(begin, end, local_size(), [&](gpu_uint base) {
+                    const gpu_uint k = base + local_id();
+                    const gpu_bool valid = (k < end);
+                    const gpu_uint kk = min(k, size - 1);
+                    const gpu_bool d = valid && is_displaced(plist, kk, size, min_bit);
+                    const gpu_uint offset = work_group_scan_exclusive_add(gpu_uint(d), local_size());
+                    gpu_if(d)
+                    {
+                        const gpu_uint pos = displaced_pos + offset;
+                        gpu_if(pos < displaced_capacity)
+                        {
+                            displaced[pos] = plist[kk];
+                        }
+                    }
+                    gpu_else
+                    {
+                        gpu_if(valid)
+                        {
+                            kept[k - (displaced_pos + offset)] = plist[kk];
+                        }
+                    }
+                    displaced_pos += shuffle(offset + gpu_uint(d), local_size() - 1, local_size());
+                });
+            },
+            ls_use,
+            gs_use);
+
+        checkfunc.assign(
+            device,
+            [](const resource<pair<key_t, CTuint>>& kept, gpu_uint size, gpu_uint min_bit, resource<CTuint>& status) {
+                const gpu_uint num_kept = size - min(status[0], size);
+                gpu_for_global(1, num_kept, [&](gpu_uint k) {
+                    gpu_if(gpu_key_t(kept[k - 1].first >> min_bit) > gpu_key_t(kept[k].first >> min_bit))
+                    {
+                        atomic_add(status[1], 1u, memory_order_relaxed);
+                    }
+                });
+            });
+
+        mergefunc.assign(device,
+                         [](const resource<pair<key_t, CTuint>>& kept,
+                            gpu_uint num_kept,
+                            const resource<pair<key_t, CTuint>>& displaced,
+                            gpu_uint num_displaced,
+                            gpu_uint min_bit,
+                            resource<pair<key_t, CTuint>>& dest) {
+                             // On equal keys, kept elements go first.
+                             gpu_for_global(0, num_kept, [&](gpu_uint k) {
+                                 const gpu_key_t key = kept[k].first >> min_bit;
+                                 dest[k + count_below(displaced, num_displaced, key, false, min_bit)] = kept[k];
+                             });
+                             gpu_for_global(0, num_displaced, [&](gpu_uint k) {
+                                 const gpu_key_t key = displaced[k].first >> min_bit;
+                                 dest[k + count_below(kept, num_kept, key, true, min_bit)] = displaced[k];
+                             });
+                         });
+    }
+};
@@ -6,6 +6,7 @@
 #include "common/particle.hpp"
 #include <SDL3/SDL_main.h>
 #include <chrono>
+#include <optional>
 #include <goopax_draw/window_sdl.h>
 #include <goopax_extra/param.hpp>
 #include <random>
@@ -17,6 +18,8 @@ using namespace std;
 
 PARAMOPT<Tsize_t> NUM_PARTICLES("num_particles", 65536); // Number of particles
 PARAMOPT<Tdouble> DT("dt", 5E-3);
+PARAMOPT<Tuint> STEPS_PER_FRAME("steps_per_frame", 1); // Simulation steps per displayed frame
+PARAMOPT<Tdouble> MAX_FPS("max_fps", 60);              // Frames are skipped if rendering would exceed this rate
 
 void init(buffer<Vector3<float>>& x, buffer<Vector3<float>>& v)
 {
@@ -101,6 +104,11 @@ int main(int argc, char** argv)
     buffer<Vector3<float>> v(device, N); // and the velocities.
     init(x, v);
 
+    // One batch of steps is kept in flight: The host only waits for the previous batch, so the device is not idle
+    // while the host renders or handles events.
+    optional<goopax_future<void>> in_flight;
+    auto last_render = steady_clock::now();
+
     bool quit = false;
     while (!quit)
     {
@@ -126,34 +134,51 @@ int main(int argc, char** argv)
 
         static auto frametime = steady_clock::now();
         static Tint framecount = 0;
+        static Tint stepcount = 0;
 
-        goopax_future f = CalculateForce(x, v, x2);
-        swap(x, x2);
+        optional<goopax_future<void>> f;
+        for (Tuint s = 0; s < STEPS_PER_FRAME(); ++s)
+        {
+            f = CalculateForce(x, v, x2);
+            swap(x, x2);
+        }
+        stepcount += STEPS_PER_FRAME();
 
         auto now = steady_clock::now();
-        ++framecount;
         if (now - frametime > chrono::seconds(1))
         {
             stringstream title;
-            Tdouble rate = framecount / chrono::duration<double>(now - frametime).count();
-            title << "N-body. N=" << N << ", " << rate << " fps, device=" << device.name();
+            const Tdouble seconds = chrono::duration<double>(now - frametime).count();
+            title << "N-body. N=" << N << ", " << stepcount / seconds << " steps/s, " << framecount / seconds
+                  << " fps, device=" << device.name();
             string s = title.str();
             SDL_SetWindowTitle(window->window, s.c_str());
             framecount = 0;
+            stepcount = 0;
             frametime = now;
         }
 
+        // Rendering is skipped if the display cannot keep up, so that the simulation does not wait for it.
+        if (now - last_render >= chrono::duration<double>(1.0 / MAX_FPS()))
+        {
+            last_render = now;
+            ++framecount;
 #if WITH_METAL
-        Renderer.render(x);
+            Renderer.render(x);
 #else
-        render(window->window, x);
-        SDL_GL_SwapWindow(window->window);
+            render(window->window, x);
+            SDL_GL_SwapWindow(window->window);
 #endif
+        }
 
         // Because there are no other synchronization points in this demo
         // (we are not evaluating any results from the GPU), this wait is
         // required to prevent endless submission of asynchronous kernel calls.
-        f.wait();
+        if (in_flight)
+        {
+            in_flight->wait();
+        }
+        in_flight = std::move(f);
     }
     return 0;
 }
@@ -0,0 +1,259 @@
+/*
+  Batched neighbor queries over the tree: all particles within a radius, and the k nearest particles.
+
+  Each thread handles one query point and searches the 27 cells around it on a tree level (see tree_grid).
+  Radius queries use the deepest level whose cells are at least as wide as the radius.
+  k-nearest-neighbor queries start at the deepest node around the query point that holds at least k particles.
+  If the k-th distance exceeds the cell width, they continue on a level with twice the cell width.
+
+  Particle indices refer to the current order of x, i.e. the order of the last tree build.
+ */
+
+// Result of a radius query in CSR form: The neighbors of query q are indices[offsets[q] ... offsets[q+1]).
+struct neighbor_list
+{
+    buffer<CTuint> offsets;
+    buffer<CTuint> indices;
+};
+
+template<class T, class node_t>
+struct neighbor_search
+{
+    using gpu_T = typename make_gpu<T>::type;
+
+    const tree_grid<T> grid;
+    const goopax_device device;
+
+    kernel<void(const buffer<node_t>& tree,
+                const buffer<Vector<T, 3>>& x,
+                const buffer<Vector<T, 3>>& queries,
+                Tuint root,
+                Tuint depth,
+                T radius,
+                buffer<CTuint>& counts)>
+        countfunc;
+
+    kernel<void(const buffer<node_t>& tree,
+                const buffer<Vector<T, 3>>& x,
+                const buffer<Vector<T, 3>>& queries,
+                Tuint root,
+                Tuint depth,
+                T radius,
+                const buffer<CTuint>& offsets,
+                buffer<CTuint>& indices)>
+        fillfunc;
+
+    using knn_kernel = kernel<void(const buffer<node_t>& tree,
+                                   const buffer<Vector<T, 3>>& x,
+                                   const buffer<Vector<T, 3>>& queries,
+                                   Tuint root,
+                                   Tuint max_depth,
+                                   buffer<CTuint>& index,
+                                   buffer<T>& dist2)>;
+    map<Tuint, knn_kernel> knnfuncs; // One kernel for each k, created on first use.
+
+    // Calls func(j, dist2) for all particles j closer than radius to q.
+    template<class FUNC>
+    void for_each_in_radius(const resource<node_t>& tree,
+                            const resource<Vector<T, 3>>& x,
+                            gpu_uint root,
+                            gpu_uint depth,
+                            const Vector<gpu_T, 3>& q,
+                            gpu_T radius,
+                            FUNC func) const
+    {
+        const gpu_T r2 = radius * radius;
+        grid.for_each_neighbor_cell(tree, root, depth, q, r2, [&](gpu_uint pbegin, gpu_uint pend) {
+            gpu_for(pbegin, pend, [&](gpu_uint j) {
+                const gpu_T d2 = (Vector<gpu_T, 3>(x[j]) - q).squaredNorm();
+                gpu_if(d2 < r2)
+                {
+                    func(j, d2);
+                }
+            });
+        });
+    }
+
+    // All particles within radius of each query point.
+    neighbor_list radius_query(const buffer<node_t>& tree,
+                               Tuint root,
+                               Tuint max_depth,
+                               const buffer<Vector<T, 3>>& x,
+                               const buffer<Vector<T, 3>>& queries,
+                               T radius)
+    {
+        const Tuint num_queries = queries.size();
+        const Tuint depth = grid.depth_for(radius, max_depth);
+
+        buffer<CTuint> counts(device, num_queries);
+        countfunc(tree, x, queries, root, depth, radius, counts);
+
+        // The total size is needed on the host anyway, to allocate the result.
+        vector<CTuint> offsets(num_queries + 1);
+        counts.copy_to_host(offsets.data());
+        Tuint sum = 0;
+        for (Tuint q = 0; q < num_queries; ++q)
+        {
+            const Tuint c = offsets[q];
+            offsets[q] = sum;
+            sum += c;
+        }
+        offsets[num_queries] = sum;
+
+        neighbor_list ret = { buffer<CTuint>(device, num_queries + 1), buffer<CTuint>(device, sum) };
+        ret.offsets.copy_from_host(offsets.data());
+        if (sum != 0)
+        {
+            fillfunc(tree, x, queries, root, depth, radius, ret.offsets, ret.indices);
+        }
+        return ret;
+    }
+
+    /*
+      The k nearest particles of each query point, sorted by distance. index and dist2 are resized to k entries per
+      query. If there are fewer than k particles, the remaining entries have index ~0u.
+     */
+    void knn_query(const buffer<node_t>& tree,
+                   Tuint root,
+                   Tuint max_depth,
+                   const buffer<Vector<T, 3>>& x,
+                   const buffer<Vector<T, 3>>& queries,
+                   Tuint k,
+                   buffer<CTuint>& index,
+                   buffer<T>& dist2)
+    {
+        if (k == 0)
+        {
+            throw std::runtime_error("knn_query: k must be at least 1");
+        }
+        if (index.size() != queries.size() * k)
+        {
+            index.assign(device, queries.size() * k);
+        }
+        if (dist2.size() != queries.size() * k)
+        {
+            dist2.assign(device, queries.size() * k);
+        }
+        auto it = knnfuncs.find(k);
+        if (it == knnfuncs.end())
+        {
+            it = knnfuncs.emplace(k, make_knn_kernel(k)).first;
+        }
+        it->second(tree, x, queries, root, max_depth, index, dist2);
+    }
+
+    knn_kernel make_knn_kernel(Tuint k)
+    {
+        knn_kernel ret;
+        ret.assign(device,
+                   [this, k](const resource<node_t>& tree,
+                             const resource<Vector<T, 3>>& x,
+                             const resource<Vector<T, 3>>& queries,
+                             gpu_uint root,
+                             gpu_uint max_depth,
+                             resource<CTuint>& index,
+                             resource<T>& dist2) {
+                       gpu_for_global(0, queries.size(), [&](gpu_uint q) {
+                           const Vector<gpu_T, 3> xq = queries[q];
+
+                           // Starting depth: the deepest node around the query point with at least k particles.
+                           const auto Lmax = grid.make_level(max_depth);
+                           const Vector<gpu_int, 3> cq = grid.cell_of(Lmax, xq);
+                           gpu_uint node = root;
+                           gpu_uint depth = 0;
+                           gpu_bool descend = true;
+                           gpu_for(0, max_depth, [&](gpu_uint j) {
+                               const gpu_uint first_child = tree[node].first_child;
+                               const gpu_uint child = first_child + grid.child_bit(Lmax, cq, j);
+                               descend = descend && first_child != 0;
+                               descend = descend && (tree[child].pend - tree[child].pbegin >= k);
+                               node = cond(descend, child, node);
+                               depth = cond(descend, j + 1, depth);
+                           });
+
+                           // Sorted lists of the k nearest particles found so far.
+                           vector<gpu_T> best_d2(k);
+                           vector<gpu_uint> best_index(k);
+                           gpu_bool done = false;
+                           gpu_while(!done)
+                           {
+                               for (Tuint m = 0; m < k; ++m)
+                               {
+                                   best_d2[m] = numeric_limits<T>::max();
+                                   best_index[m] = ~0u;
+                               }
+                               grid.for_each_neighbor_cell(
+                                   tree, root, depth, xq, best_d2[k - 1], [&](gpu_uint pbegin, gpu_uint pend) {
+                                       gpu_for(pbegin, pend, [&](gpu_uint j) {
+                                           // Insertion into the sorted list.
+                                           gpu_T d2 = (Vector<gpu_T, 3>(x[j]) - xq).squaredNorm();
+                                           gpu_uint i = j;
+                                           for (Tuint m = 0; m < k; ++m)
+                                           {
+                                               const gpu_bool closer = (d2 < best_d2[m]);
+                                               const gpu_T old_d2 = best_d2[m];
+                                               const gpu_uint old_index = best_index[m];
+                                               best_d2[m] = cond(closer, d2, old_d2);
+                                               best_index[m] = cond(closer, i, old_index);
+                                               d2 = cond(closer, old_d2, d2);
+                                               i = cond(closer, old_index, i);
+                                           }
+                                       });
+                                   });
+                               // The 27 cells contain everything within one cell width. Otherwise, the next level
+                               // with twice the cell width is searched.
+                               const gpu_T cellsize = grid.min_cellsize(grid.make_level(depth));
+                               done = (depth == 0 || best_d2[k - 1] <= cellsize * cellsize);
+                               depth = cond(done, depth, cond(depth >= 3, depth - 3, 0u));
+                           }
+                           for (Tuint m = 0; m < k; ++m)
+                           {
+                               index[q * k + m] = best_index[m];
+                               dist2[q * k + m] = best_d2[m];
+                           }
+                       });
+                   });
+        return ret;
+    }
+
+    neighbor_search(goopax_device device0, Tdouble halflen)
+        : grid(halflen)
+        , device(device0)
+    {
+        countfunc.assign(device,
+                         [this](const resource<node_t>& tree,
+                                const resource<Vector<T, 3>>& x,
+                                const resource<Vector<T, 3>>& queries,
+                                gpu_uint root,
+                                gpu_uint depth,
+                                gpu_T radius,
+                                resource<CTuint>& counts) {
+                             gpu_for_global(0, queries.size(), [&](gpu_uint q) {
+                                 const Vector<gpu_T, 3> xq = queries[q];
+                                 gpu_uint count = 0;
+                                 auto add = [&](gpu_uint, gpu_T) { ++count; };
+                                 for_each_in_radius(tree, x, root, depth, xq, radius, add);
+                                 counts[q] = count;
+                             });
+                         });
+
+        fillfunc.assign(device,
+                        [this](const resource<node_t>& tree,
+                               const resource<Vector<T, 3>>& x,
+                               const resource<Vector<T, 3>>& queries,
+                               gpu_uint root,
+                               gpu_uint depth,
+                               gpu_T radius,
+                               const resource<CTuint>& offsets,
+                               resource<CTuint>& indices) {
+                            gpu_for_global(0, queries.size(), [&](gpu_uint q) {
+                                const Vector<gpu_T, 3> xq = queries[q];
+                                gpu_uint pos = offsets[q];
+                                for_each_in_radius(tree, x, root, depth, xq, radius, [&](gpu_uint j, gpu_T) {
+                                    indices[pos] = j;
+                                    ++pos;
+                                });
+                            });
+                        });
+    }
+};
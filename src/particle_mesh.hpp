@@ -0,0 +1,422 @@
+/*
+  Long-range forces on a mesh, for the TreePM split of the gravitational potential.
+
+  The potential -1/r of a point mass is split into a long-range part -erf(r / (2 r_s)) / r, which is calculated here,
+  and a short-range part -erfc(r / (2 r_s)) / r, which is left to the tree. Beyond a few r_s, the short-range part
+  vanishes.
+
+  The masses are deposited onto the mesh nodes with cloud-in-cell weights. The potential is the convolution with the
+  long-range kernel, calculated by FFT. The simulation box is not periodic, so the FFT size is at least twice the mesh
+  size in each dimension, and the kernel is given in real space. The forces are four-point finite differences of the
+  potential, interpolated back to the particles with the same weights.
+ */
+
+#include <complex>
+#include <goopax_extra/fft.hpp>
+#include <numbers>
+
+/*
+  Short-range kernel erfc(u) / r, with u = r / (2 r_s): The m-th radial derivative (d / r dr)^m is s[m] times that
+  of 1/r, with s[m] = erfc(u) + 2u/sqrt(pi) exp(-u^2) sum_{k<m} (2u^2)^k / (2k+1)!!.
+  erfc uses the approximation 7.1.26 of Abramowitz and Stegun, with an absolute error below 1.5E-7.
+ */
+template<Tuint M, class T>
+array<T, M> short_range_derivative_factors(T u)
+{
+    const T e = exp(-u * u);
+    const T t = T(1) / (T(1) + 0.3275911f * u);
+    array<T, M> s;
+    s[0] = t * (0.254829592f + t * (-0.284496736f + t * (1.421413741f + t * (-1.453152027f + t * 1.061405429f)))) * e;
+    T term = 1.1283791671f * u * e;
+    for (Tuint m = 1; m < M; ++m)
+    {
+        s[m] = s[m - 1] + term;
+        term *= (2 * u * u) * (1.0f / (2 * m + 1));
+    }
+    return s;
+}
+
+// Fractions of the potential and of the force of a point mass at distance r = 2 r_s u that belong to the short-range
+// part.
+template<class T>
+pair<T, T> short_range_factors(T u)
+{
+    const array<T, 2> s = short_range_derivative_factors<2>(u);
+    return { s[0], s[1] };
+}
+
+template<class T>
+struct particle_mesh
+{
+    using gpu_T = typename make_gpu<T>::type;
+
+    static constexpr Tuint margin = 2; // Mesh nodes outside of the box on the lower side, for the finite differences.
+
+    const Vector<Tdouble, 3> boxlen; // Half-length of the simulation box in each dimension
+    const Tdouble cellsize;
+    const Tdouble split;           // r_s
+    const Vector<Tuint, 3> size;   // Mesh nodes in each dimension
+    const Vector<Tuint, 3> padded; // FFT size in each dimension
+
+    buffer<T> density; // Mass at each mesh node
+    buffer<T> phi;     // Potential at each mesh node
+    buffer<T> green;   // Fourier transform of the long-range kernel
+    buffer<complex<T>> tmp1;
+    buffer<complex<T>> tmp2;
+
+    kernel<void(const buffer<Vector<T, 3>>& x, const buffer<T>& mass, buffer<T>& density)> depositfunc;
+
+    // Forward transform of src, which has src_size nodes. The remaining nodes of the FFT grid are zero.
+    kernel<void(const buffer<T>& src, Tuint sx, Tuint sy, Tuint sz)> fft_x;
+    kernel<void(Tuint sy, Tuint sz)> fft_y;
+    kernel<void(Tuint sz)> fft_z;
+
+    // Inverse transform of the product with green. Only the mesh nodes are calculated.
+    kernel<void()> ifft_z;
+    kernel<void()> ifft_y;
+    kernel<void()> ifft_x;
+
+    kernel<void()> normfunc;
+    kernel<void()> greenfunc;
+
+    kernel<void(const buffer<Vector<T, 3>>& x,
+                const buffer<T>& mass,
+                const buffer<T>& phi,
+                buffer<Vector<T, 3>>& acc,
+                buffer<T>& potential,
+                const buffer<CTuint>& timebin,
+                Tuint min_active_bin)>
+        forcefunc;
+
+    static Tdouble mesh_cellsize(Tdouble halflen, Tuint cells)
+    {
+        return 2 * halflen / cells;
+    }
+
+    // The box is covered from its lower edge minus margin nodes up to its upper edge plus margin + 1 nodes.
+    static Vector<Tuint, 3> mesh_size(Tdouble halflen, Tuint cells)
+    {
+        Vector<Tuint, 3> ret;
+        for (Tuint k = 0; k < 3; ++k)
+        {
+            const Tdouble len = 2 * halflen * pow(2.0, (2.0 - k) / 3);
+            ret[k] = Tuint(ceil(len / mesh_cellsize(halflen, cells) - 1E-9)) + 2 * margin + 2;
+        }
+        return ret;
+    }
+
+    // Smallest size of the form 2^a 3^b with a >= 4, that is at least twice the mesh size.
+    static Vector<Tuint, 3> fft_size(const Vector<Tuint, 3>& size)
+    {
+        Vector<Tuint, 3> ret;
+        for (Tuint k = 0; k < 3; ++k)
+        {
+            ret[k] = numeric_limits<Tuint>::max();
+            for (Tuint p3 = 1; p3 < 2 * size[k] * 3; p3 *= 3)
+            {
+                Tuint n = 16 * p3;
+                while (n < 2 * size[k])
+                {
+                    n *= 2;
+                }
+                ret[k] = min(ret[k], n);
+            }
+        }
+        return ret;
+    }
+
+    // Device memory for the given mesh, in bytes.
+    static Tsize_t estimate_memory(Tdouble halflen, Tuint cells)
+    {
+        const Vector<Tuint, 3> s = mesh_size(halflen, cells);
+        const Vector<Tuint, 3> p = fft_size(s);
+        const Tsize_t num_fft = Tsize_t(p[0]) * p[1] * p[2];
+        return 2 * Tsize_t(s[0]) * s[1] * s[2] * sizeof(T) + num_fft * (sizeof(T) + 2 * sizeof(complex<T>));
+    }
+
+    Tsize_t memory_usage() const
+    {
+        return (density.size() + phi.size() + green.size()) * sizeof(T)
+               + (tmp1.size() + tmp2.size()) * sizeof(complex<T>);
+    }
+
+    // Threads per line. fft_workgroup needs a power of two that divides the line length.
+    static Tuint line_threads(Tuint n)
+    {
+        return min(local_size(), ((n ^ (n - 1)) + 1) / 2);
+    }
+
+    gpu_uint fft_index(gpu_uint x, gpu_uint y, gpu_uint z) const
+    {
+        return x + padded[0] * (y + padded[1] * z);
+    }
+
+    // Lower mesh node of the cloud-in-cell interpolation, and the weights of the upper nodes.
+    pair<Vector<gpu_uint, 3>, Vector<gpu_T, 3>> cic(const Vector<gpu_T, 3>& x) const
+    {
+        Vector<gpu_uint, 3> node;
+        Vector<gpu_T, 3> w;
+        for (Tuint k = 0; k < 3; ++k)
+        {
+            const gpu_T u = (x[k] + (T)boxlen[k]) * (T)(1 / cellsize) + (T)margin;
+            const gpu_T f = clamp(floor(u), (T)margin, (T)(size[k] - margin - 2));
+            node[k] = gpu_uint(f);
+            w[k] = clamp(u - f, (T)0, (T)1);
+        }
+        return { node, w };
+    }
+
+    gpu_uint mesh_index(const Vector<gpu_uint, 3>& node) const
+    {
+        return node[0] + size[0] * (node[1] + size[1] * node[2]);
+    }
+
+    /*
+      Adds the long-range forces and potentials to acc and potential of the particles with timebin >= min_active_bin.
+      The potential of each particle excludes its own contribution.
+     */
+    void add_forces(const buffer<Vector<T, 3>>& x,
+                    const buffer<T>& mass,
+                    buffer<Vector<T, 3>>& acc,
+                    buffer<T>& potential,
+                    const buffer<CTuint>& timebin,
+                    Tuint min_active_bin)
+    {
+        density.fill(0);
+        depositfunc(x, mass, density);
+        fft_x(density, size[0], size[1], size[2]);
+        fft_y(size[1], size[2]);
+        fft_z(size[2]);
+        ifft_z();
+        ifft_y();
+        ifft_x();
+        Timings.mark("pm", forcefunc(x, mass, phi, acc, potential, timebin, min_active_bin));
+    }
+
+    particle_mesh(goopax_device device, Tdouble halflen, Tuint cells, Tdouble split_cells)
+        : boxlen({ halflen * pow(2.0, 2.0 / 3), halflen * pow(2.0, 1.0 / 3), halflen })
+        , cellsize(mesh_cellsize(halflen, cells))
+        , split(split_cells * cellsize)
+        , size(mesh_size(halflen, cells))
+        , padded(fft_size(size))
+        , density(device, size[0] * size[1] * size[2])
+        , phi(device, density.size())
+        , green(device, padded[0] * padded[1] * padded[2])
+        , tmp1(device, green.size())
+        , tmp2(device, green.size())
+    {
+        cout << "particle mesh: " << size << " nodes, FFT size " << padded << ", r_s=" << split << endl;
+
+        depositfunc.assign(device,
+                           [this](const resource<Vector<T, 3>>& x, const resource<T>& mass, resource<T>& density) {
+                               gpu_for_global(0, x.size(), [&](gpu_uint p) {
+                                   const auto [node, w] = cic(Vector<gpu_T, 3>(x[p]));
+                                   for (Tuint c = 0; c < 8; ++c)
+                                   {
+                                       gpu_T weight = mass[p];
+                                       Vector<gpu_uint, 3> n = node;
+                                       for (Tuint k = 0; k < 3; ++k)
+                                       {
+                                           weight *= ((c >> k) & 1) ? w[k] : 1 - w[k];
+                                           n[k] += (c >> k) & 1;
+                                       }
+                                       atomic_add(density[mesh_index(n)], weight, memory_order_relaxed);
+                                   }
+                               });
+                           });
+
+        fft_x.assign(device, [this](const resource<T>& src, gpu_uint sx, gpu_uint sy, gpu_uint sz) {
+            const Tuint ls = line_threads(padded[0]);
+            gpu_for(global_id() / ls, sy * sz, global_size() / ls, [&](gpu_uint line) {
+                fft_workgroup<gpu_T>(
+                    [&](gpu_uint x) {
+                        const gpu_T value = src[min(x, sx - 1) + sx * line];
+                        return complex<gpu_T>(cond(x < sx, value, gpu_T(0)), 0);
+                    },
+                    [&](gpu_uint x, complex<gpu_T> value) { this->tmp1[fft_index(x, line % sy, line / sy)] = value; },
+                    padded[0],
+                    ls);
+            });
+        });
+
+        fft_y.assign(device, [this](gpu_uint sy, gpu_uint sz) {
+            const Tuint ls = line_threads(padded[1]);
+            gpu_for(global_id() / ls, padded[0] * sz, global_size() / ls, [&](gpu_uint line) {
+                const gpu_uint x = line % padded[0];
+                const gpu_uint z = line / padded[0];
+                fft_workgroup<gpu_T>(
+                    [&](gpu_uint y) {
+                        const complex<gpu_T> c = this->tmp1[fft_index(x, y, z)];
+                        return complex<gpu_T>(cond(y < sy, c.real(), gpu_T(0)), cond(y < sy, c.imag(), gpu_T(0)));
+                    },
+                    [&](gpu_uint y, complex<gpu_T> value) { this->tmp2[fft_index(x, y, z)] = value; },
+                    padded[1],
+                    ls);
+            });
+        });
+
+        fft_z.assign(device, [this](gpu_uint sz) {
+            const Tuint ls = line_threads(padded[2]);
+            gpu_for(global_id() / ls, padded[0] * padded[1], global_size() / ls, [&](gpu_uint line) {
+                fft_workgroup<gpu_T>(
+                    [&](gpu_uint z) {
+                        const complex<gpu_T> c = this->tmp2[line + padded[0] * padded[1] * z];
+                        return complex<gpu_T>(cond(z < sz, c.real(), gpu_T(0)), cond(z < sz, c.imag(), gpu_T(0)));
+                    },
+                    [&](gpu_uint z, complex<gpu_T> value) { this->tmp1[line + padded[0] * padded[1] * z] = value; },
+                    padded[2],
+                    ls);
+            });
+        });
+
+        ifft_z.assign(device, [this]() {
+            const Tuint ls = line_threads(padded[2]);
+            gpu_for(global_id() / ls, padded[0] * padded[1], global_size() / ls, [&](gpu_uint line) {
+                ifft_workgroup<gpu_T>(
+                    [&](gpu_uint z) {
+                        const gpu_uint i = line + padded[0] * padded[1] * z;
+                        return complex<gpu_T>(this->tmp1[i]) * gpu_T(this->green[i]);
+                    },
+                    [&](gpu_uint z, complex<gpu_T> value) {
+                        gpu_if(z < size[2])
+                        {
+                            this->tmp2[line + padded[0] * padded[1] * z] = value;
+                        }
+                    },
+                    padded[2],
+                    ls);
+            });
+        });
+
+        ifft_y.assign(device, [this]() {
+            const Tuint ls = line_threads(padded[1]);
+            gpu_for(global_id() / ls, padded[0] * size[2], global_size() / ls, [&](gpu_uint line) {
+                const gpu_uint x = line % padded[0];
+                const gpu_uint z = line / padded[0];
+                ifft_workgroup<gpu_T>([&](gpu_uint y) { return this->tmp2[fft_index(x, y, z)]; },
+                                      [&](gpu_uint y, complex<gpu_T> value) {
+                                          gpu_if(y < size[1])
+                                          {
+                                              this->tmp1[fft_index(x, y, z)] = value;
+                                          }
+                                      },
+                                      padded[1],
+                                      ls);
+            });
+        });
+
+        ifft_x.assign(device, [this]() {
+            const Tuint ls = line_threads(padded[0]);
+            gpu_for(global_id() / ls, size[1] * size[2], global_size() / ls, [&](gpu_uint line) {
+                const gpu_uint y = line % size[1];
+                const gpu_uint z = line / size[1];
+                ifft_workgroup<gpu_T>([&](gpu_uint x) { return this->tmp1[fft_index(x, y, z)]; },
+                                      [&](gpu_uint x, complex<gpu_T> value) {
+                                          gpu_if(x < size[0])
+                                          {
+                                              this->phi[x + size[0] * line] = value.real();
+                                          }
+                                      },
+                                      padded[0],
+                                      ls);
+            });
+        });
+
+        /*
+          Transforms of the delta function and of the kernel, both in tmp1. Dividing by the former removes the
+          normalization of the forward transform, so that the inverse transform of the product is the convolution.
+          The cloud-in-cell window is applied twice, by the deposit and by the interpolation, and is divided out.
+         */
+        normfunc.assign(device, [this]() {
+            gpu_for_global(0, this->green.size(), [&](gpu_uint i) {
+                this->green[i] = complex<gpu_T>(this->tmp1[i]).real();
+            });
+        });
+        greenfunc.assign(device, [this]() {
+            gpu_for_global(0, this->green.size(), [&](gpu_uint i) {
+                const Vector<gpu_uint, 3> f = { i % padded[0],
+                                                (i / padded[0]) % padded[1],
+                                                i / (padded[0] * padded[1]) };
+                gpu_T window = 1;
+                for (Tuint k = 0; k < 3; ++k)
+                {
+                    const gpu_T a = static_cast<gpu_T>(min(f[k], padded[k] - f[k])) * (T)(numbers::pi / padded[k]);
+                    window *= pow2(pow2(cond(a == 0, gpu_T(1), sin(a) / a)));
+                }
+                this->green[i] = complex<gpu_T>(this->tmp1[i]).real() / (this->green[i] * window);
+            });
+        });
+
+        forcefunc.assign(device,
+                         [this](const resource<Vector<T, 3>>& x,
+                                const resource<T>& mass,
+                                const resource<T>& phi,
+                                resource<Vector<T, 3>>& acc,
+                                resource<T>& potential,
+                                const resource<CTuint>& timebin,
+                                gpu_uint min_active_bin) {
+                             const array<Tuint, 3> stride = { 1, size[0], size[0] * size[1] };
+                             gpu_for_global(0, x.size(), [&](gpu_uint p) {
+                                 gpu_if(timebin[p] >= min_active_bin)
+                                 {
+                                     const auto [node, w] = cic(Vector<gpu_T, 3>(x[p]));
+                                     Vector<gpu_T, 3> F = { 0, 0, 0 };
+                                     gpu_T pot = 0;
+                                     for (Tuint c = 0; c < 8; ++c)
+                                     {
+                                         gpu_T weight = 1;
+                                         Vector<gpu_uint, 3> n = node;
+                                         for (Tuint k = 0; k < 3; ++k)
+                                         {
+                                             weight *= ((c >> k) & 1) ? w[k] : 1 - w[k];
+                                             n[k] += (c >> k) & 1;
+                                         }
+                                         const gpu_uint i = mesh_index(n);
+                                         pot += weight * phi[i];
+                                         for (Tuint k = 0; k < 3; ++k)
+                                         {
+                                             const gpu_uint s = stride[k];
+                                             F[k] -= weight
+                                                     * (2.0f / 3 * (phi[i + s] - phi[i - s])
+                                                        - 1.0f / 12 * (phi[i + 2 * s] - phi[i - 2 * s]));
+                                         }
+                                     }
+                                     acc[p] += F * (T)(1 / cellsize);
+                                     // Removing the self-interaction, -m / (sqrt(pi) r_s) for a point mass.
+                                     potential[p] += pot + mass[p] * (T)(1 / (sqrt(numbers::pi) * split));
+                                 }
+                             });
+                         });
+
+        // The kernel in real space, with the distances of the periodic FFT grid.
+        vector<T> host_src(green.size(), 0);
+        buffer<T> src(device, green.size());
+        host_src[0] = 1;
+        src.copy_from_host(host_src.data());
+        fft_x(src, padded[0], padded[1], padded[2]);
+        fft_y(padded[1], padded[2]);
+        fft_z(padded[2]);
+        normfunc();
+
+        for (Tuint z = 0; z < padded[2]; ++z)
+        {
+            for (Tuint y = 0; y < padded[1]; ++y)
+            {
+                for (Tuint x = 0; x < padded[0]; ++x)
+                {
+                    const Vector<Tdouble, 3> d = { Tdouble(min(x, padded[0] - x)),
+                                                   Tdouble(min(y, padded[1] - y)),
+                                                   Tdouble(min(z, padded[2] - z)) };
+                    const Tdouble r = d.norm() * cellsize;
+                    host_src[x + padded[0] * (y + padded[1] * z)] =
+                        (r == 0 ? -1 / (sqrt(numbers::pi) * split) : -erf(r / (2 * split)) / r);
+                }
+            }
+        }
+        src.copy_from_host(host_src.data());
+        fft_x(src, padded[0], padded[1], padded[2]);
+        fft_y(padded[1], padded[2]);
+        fft_z(padded[2]);
+        greenfunc();
+    }
+};
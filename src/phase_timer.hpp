@@ -0,0 +1,97 @@
+/*
+  Per-phase timing without device synchronization.
+
+  Each phase is marked by the future of its last kernel. When that kernel completes, a callback records the time.
+  A phase starts when the previous phase completed, or when its first kernel was enqueued, whichever is later.
+  Since kernels run in order, this gives the device time of each phase, without waiting for the device
+  between phases.
+
+  The results can be written as JSON lines (one object per phase and step), or as a Chrome trace
+  (chrome://tracing, https://ui.perfetto.dev).
+ */
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class phase_timer
+{
+    struct record
+    {
+        const char* phase;
+        uint64_t step;
+        double begin; // microseconds since start
+        double end;
+    };
+
+    std::mutex mutex;
+    std::vector<record> records;
+    const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    double last_completion = 0;
+    double last_enqueue = 0;
+
+    double now() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+public:
+    bool enabled = false;
+    uint64_t step = 0;
+
+    // Marks the end of a phase. 'last' is the future of the last kernel call of the phase.
+    template<class FUTURE>
+    void mark(const char* phase, FUTURE&& last)
+    {
+        if (!enabled)
+            return;
+        const double enqueue = last_enqueue;
+        last_enqueue = now();
+        last.set_callback([this, phase, step = this->step, enqueue]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            const double t = now();
+            records.push_back({ phase, step, std::max(last_completion, enqueue), t });
+            last_completion = t;
+        });
+    }
+
+    // Starts a new phase at the current host time, e.g. after a host synchronization.
+    void restart()
+    {
+        last_enqueue = now();
+    }
+
+    void write(const std::string& filename, bool chrome_trace)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(filename);
+        if (chrome_trace)
+        {
+            out << "{\"traceEvents\":[\n";
+            for (size_t k = 0; k < records.size(); ++k)
+            {
+                const record& r = records[k];
+                out << "{\"name\":\"" << r.phase << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << r.begin
+                    << ",\"dur\":" << r.end - r.begin << ",\"args\":{\"step\":" << r.step << "}}"
+                    << (k + 1 < records.size() ? ",\n" : "\n");
+            }
+            out << "]}\n";
+        }
+        else
+        {
+            for (const record& r : records)
+            {
+                out << "{\"step\":" << r.step << ",\"phase\":\"" << r.phase << "\",\"begin_us\":" << r.begin
+                    << ",\"duration_us\":" << r.end - r.begin << "}\n";
+            }
+        }
+        if (!out)
+        {
+            throw std::runtime_error("Failed to write " + filename);
+        }
+    }
+};
+
+inline phase_timer Timings;
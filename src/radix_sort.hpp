@@ -11,6 +11,13 @@ GOOPAX_PREPARE_STRUCT(std::pair)
     template<typename XX>               \
     using goopax_struct_changetype = NAME<typename goopax_struct_changetype<X, XX>::type>;
 
+// Lowest 32 bits of a sort key. Keys that are not plain integers provide their own overload.
+template<class K>
+gpu_uint low_bits(const K& key)
+{
+    return gpu_uint(key);
+}
+
 template<class key_t>
 struct radix_sort
 {
@@ -128,33 +135,37 @@ struct radix_sort
                 buffer<pair<key_t, CTuint>>& tmp,
                 buffer<smallrange_info<>>& smallrange,
                 const Tuint smallrange_size,
-                const Tuint smallrange_maxsize)>
+                const Tuint smallrange_maxsize,
+                const Tuint min_bit)>
         smallsortfunc;
 
 #ifndef NDEBUG
-    kernel<void(const buffer<pair<key_t, CTuint>>& p, Tuint size)> testsortfunc;
+    kernel<void(const buffer<pair<key_t, CTuint>>& p, Tuint size, Tuint min_bit)> testsortfunc;
 #endif
 
-    void operator()(buffer<pair<key_t, CTuint>>& plist1, buffer<pair<key_t, CTuint>>& plist2, const Tuint max_depthbits)
+    // Sorts the first 'size' elements of plist1. Uses plist2 as temporary storage.
+    // Only the key bits from min_bit up to max_depthbits are sorted. The order of keys that only differ in the bits
+    // below min_bit is unspecified.
+    void operator()(buffer<pair<key_t, CTuint>>& plist1,
+                    buffer<pair<key_t, CTuint>>& plist2,
+                    const Tuint max_depthbits,
+                    Tuint size = numeric_limits<Tuint>::max(),
+                    const Tuint min_bit = 0)
     {
         goopax_device device = plist1.get_device();
+        size = min(size, Tuint(plist1.size()));
         const unsigned int bits = bigrange_bits;
 
         vector<pair<CTuint, CTuint>> bigrangevec;
         bigrangevec.reserve(this->ranges.size());
-        bigrangevec.assign({ { 0, plist1.size() } });
+        bigrangevec.assign({ { 0, size } });
 
         vector<smallrange_info<>> smallrangevec;
         smallrangevec.reserve(this->smallrange.size());
 
-#if WITH_TIMINGS
-        device.wait_all();
-        auto t0 = steady_clock::now();
-#endif
-
-        for (Tint shift_i = Tint(max_depthbits) - bits; shift_i >= -Tint(bits) + 1; shift_i -= bits)
+        for (Tint shift_i = Tint(max_depthbits) - bits; shift_i >= Tint(min_bit) - Tint(bits) + 1; shift_i -= bits)
         {
-            Tuint shift = max(shift_i, 0);
+            Tuint shift = max(shift_i, Tint(min_bit));
             // cout << "\nshift=" << shift << endl;
 
             if (bigrangevec.empty())
@@ -185,22 +196,22 @@ struct radix_sort
                 const_buffer_map<Tuint> key_offsets(this->key_offsets);
 
                 vector<pair<Tuint, Tuint>> newbigrangevec;
-                const Tsize_t max_size = max(plist1.size() / (2 * ng_use), (Tuint)256);
+                const Tsize_t max_size = max(size / (2 * ng_use), (Tuint)256);
                 for (Tuint r = 0; r < bigrangevec.size(); ++r)
                 {
                     Tuint begin = bigrangevec[r].first;
                     for (Tuint key = 0; key < (1u << bits); ++key)
                     {
-                        auto size = key_offsets[r * (1 << bits) + key];
-                        if (size > max_size)
+                        const Tuint count = key_offsets[r * (1 << bits) + key];
+                        if (count > max_size)
                         {
-                            newbigrangevec.push_back({ begin, begin + size });
+                            newbigrangevec.push_back({ begin, begin + count });
                         }
-                        else if (size >= 1)
+                        else if (count >= 1)
                         {
-                            smallrangevec.push_back({ begin, begin + size, shift });
+                            smallrangevec.push_back({ begin, begin + count, shift - min_bit });
                         }
-                        begin += size;
+                        begin += count;
                     }
                 }
                 bigrangevec = std::move(newbigrangevec);
@@ -213,28 +224,24 @@ struct radix_sort
 
             if (!smallrangevec.empty())
             {
-                plist2.copy(plist1);
+                plist2.copy(plist1, size, 0, 0);
             }
 
-            radix_writefunc(
+            auto written = radix_writefunc(
                 plist1, ranges, old_bigrangevecsize, local_offsets, group_offsets, key_offsets, shift, plist2);
+            Timings.mark("sort_bigrange", written);
 
             cout1 << "Swapping" << endl;
             swap(plist1, plist2);
         }
 
-#if WITH_TIMINGS
-        device.wait_all();
-        auto t1 = steady_clock::now();
-#endif
-
         enum
         {
             max_bits_hardlimit = 8
         };
         Tsize_t maxsize = smallrangevec.size()
                           + ng_use * ((1 << max_bits_hardlimit) - 1)
-                                * ((max_depthbits + max_bits_hardlimit - 1) / max_bits_hardlimit);
+                                * ((max_depthbits - min_bit + max_bits_hardlimit - 1) / max_bits_hardlimit);
         // maxsize += ((1<<smallsort::bits)-1) * (max_depthbits / radix_sort::smallsort::bits) * num_groups();
         if (smallrange.size() < maxsize)
         {
@@ -245,24 +252,24 @@ struct radix_sort
             buffer_map smallrange(this->smallrange);
             std::copy(smallrangevec.begin(), smallrangevec.end(), smallrange.begin());
         }
-        smallsortfunc(plist1, plist2, smallrange, smallrangevec.size(), smallrange.size());
+        Timings.mark("sort_smallrange",
+                     smallsortfunc(plist1, plist2, smallrange, smallrangevec.size(), smallrange.size(), min_bit));
 
         //    cout1 << "plist1=" << plist1 << endl;
-#if WITH_TIMINGS
-        device.wait_all();
-        auto t2 = steady_clock::now();
-#endif
-
-#if WITH_TIMINGS
-        cout << "bigrange: " << duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << endl;
-        cout << "smallrange: " << duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms" << endl;
-#endif
 
 #ifndef NDEBUG
-        testsortfunc(plist1, plist1.size());
+        testsortfunc(plist1, size, min_bit);
 #endif
     }
 
+    // Device memory of the scratch buffers, in bytes. The buffers grow on demand.
+    Tsize_t memory_usage() const
+    {
+        return ranges.size() * sizeof(pair<CTuint, CTuint>)
+               + (local_offsets.size() + group_offsets.size() + key_offsets.size()) * sizeof(CTuint)
+               + smallrange.size() * sizeof(smallrange_info<>);
+    }
+
     radix_sort(goopax_device device)
         : ls_use(device.default_local_size())
         , gs_use(device.default_global_size_min())
@@ -310,7 +317,7 @@ struct radix_sort
                     const gpu_uint end = ranges[r].second;
 
                     gpu_for_global(begin, end, [&](gpu_uint k) {
-                        gpu_uint key = gpu_uint(src[k].first >> shift) & ((1 << bigrange_bits) - 1);
+                        gpu_uint key = low_bits(src[k].first >> shift) & ((1 << bigrange_bits) - 1);
                         ++localcount[key];
                     });
                     gpu_for(0, (1 << bigrange_bits), [&](gpu_uint key) {
@@ -403,7 +410,7 @@ struct radix_sort
                     const gpu_uint begin = ranges[r].first;
                     const gpu_uint end = ranges[r].second;
                     gpu_for_global(begin, end, [&](gpu_uint k) {
-                        gpu_uint key = gpu_uint(src[k].first >> shift) & ((1 << bigrange_bits) - 1);
+                        gpu_uint key = low_bits(src[k].first >> shift) & ((1 << bigrange_bits) - 1);
                         gpu_uint pos = offsets[key]++;
                         dest[pos] = src[k];
                     });
@@ -418,7 +425,8 @@ struct radix_sort
                    resource<pair<key_t, CTuint>>& tmp,
                    resource<smallrange_info<>>& smallrange,
                    const gpu_uint smallrange_size,
-                   const gpu_uint smallrange_maxsize) {
+                   const gpu_uint smallrange_maxsize,
+                   const gpu_uint min_bit) {
                 smallrange_info<gpu_uint> myrange;
 
                 gpu_uint num_tiny = 0;
@@ -454,7 +462,7 @@ struct radix_sort
                         gpu_for(0, (1u << bits), [&](gpu_uint key) { count[key] = 0; });
 
                         gpu_for_local(range.begin, range.end, [&](gpu_uint k) {
-                            gpu_uint key = gpu_uint(src[k].first >> (max(range.bits, bits) - bits))
+                            gpu_uint key = low_bits(src[k].first >> (max(range.bits, bits) - bits + min_bit))
                                            & ((1u << bits) - 1); // FIXME: Make range.bits%bits==0.
                             gpu_assert(bits <= 32u);
                             ++count[key];
@@ -476,7 +484,7 @@ struct radix_sort
                         });
 
                         gpu_for_local(range.begin, range.end, [&](gpu_uint k) {
-                            gpu_uint key = gpu_uint(src[k].first >> (max(range.bits, bits) - bits))
+                            gpu_uint key = low_bits(src[k].first >> (max(range.bits, bits) - bits + min_bit))
                                            & ((1u << bits) - 1); // FIXME: Make range.bits%bits==0.
                             gpu_uint pos = count[key]++;
                             tmp[pos] = src[k];
@@ -502,8 +510,10 @@ struct radix_sort
             gs_use);
 
 #ifndef NDEBUG
-        testsortfunc.assign(device, [](const resource<pair<key_t, CTuint>>& p, gpu_uint size) {
-            gpu_for_global(0, size - 1, [&](gpu_uint k) { gpu_assert(p[k].first <= p[k + 1].first); });
+        testsortfunc.assign(device, [](const resource<pair<key_t, CTuint>>& p, gpu_uint size, gpu_uint min_bit) {
+            gpu_for_global(0, size - 1, [&](gpu_uint k) {
+                gpu_assert((p[k].first >> min_bit) <= (p[k + 1].first >> min_bit));
+            });
         });
 #endif
     }
@@ -0,0 +1,314 @@
+#pragma once
+
+/*
+  Binary snapshot format used by the cosmology example for checkpoint and restart.
+
+  Layout:
+  - snapshot_header at offset 0,
+  - followed by the structure-of-arrays payload x, v, mass [, potential].
+  Every array starts at a multiple of snapshot_alignment, so that a memory-mapped
+  file can be handed to buffer::copy_from_host directly, without touching the data on the host.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <goopax>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_WITH_MMAP 1
+#else
+#define SNAPSHOT_WITH_MMAP 0
+#endif
+
+constexpr char snapshot_magic[8] = { 'G', 'P', 'X', 'S', 'N', 'A', 'P', 0 };
+constexpr uint32_t snapshot_version = 1;
+constexpr uint64_t snapshot_alignment = 4096;
+
+enum snapshot_flags : uint32_t
+{
+    snapshot_has_potential = 1
+};
+
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t num_particles;
+    uint32_t scalar_size; // sizeof(T) of the stored arrays
+    uint32_t flags;
+    uint64_t step;
+    double time;
+
+    // Byte offsets from the start of the file.
+    uint64_t offset_x;
+    uint64_t offset_v;
+    uint64_t offset_mass;
+    uint64_t offset_potential;
+
+    template<class T>
+    static snapshot_header make(uint64_t num_particles, uint64_t step, double time, bool with_potential)
+    {
+        snapshot_header h = {};
+        std::memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+        h.version = snapshot_version;
+        h.header_size = sizeof(snapshot_header);
+        h.num_particles = num_particles;
+        h.scalar_size = sizeof(T);
+        h.flags = (with_potential ? snapshot_has_potential : 0);
+        h.step = step;
+        h.time = time;
+
+        uint64_t pos = align(sizeof(snapshot_header));
+        h.offset_x = pos;
+        pos = align(pos + num_particles * 3 * sizeof(T));
+        h.offset_v = pos;
+        pos = align(pos + num_particles * 3 * sizeof(T));
+        h.offset_mass = pos;
+        pos = align(pos + num_particles * sizeof(T));
+        h.offset_potential = (with_potential ? pos : 0);
+        return h;
+    }
+
+    uint64_t file_size() const
+    {
+        if (flags & snapshot_has_potential)
+            return offset_potential + num_particles * scalar_size;
+        return offset_mass + num_particles * scalar_size;
+    }
+
+    // Validates the header of a file with file_size bytes. All sections must be aligned and lie within the file.
+    void check(uint32_t expected_scalar_size, uint64_t file_size) const
+    {
+        if (std::memcmp(magic, snapshot_magic, sizeof(magic)) != 0)
+        {
+            throw std::runtime_error("Not a snapshot file");
+        }
+        if (version != snapshot_version || header_size != sizeof(snapshot_header))
+        {
+            throw std::runtime_error("Unsupported snapshot version " + std::to_string(version));
+        }
+        if (scalar_size != expected_scalar_size)
+        {
+            throw std::runtime_error("Snapshot has scalar size " + std::to_string(scalar_size) + ", expected "
+                                     + std::to_string(expected_scalar_size));
+        }
+        auto check_section = [&](const char* name, uint64_t offset, uint64_t components) {
+            // Written as a division, so that a corrupt num_particles cannot overflow.
+            if (offset % snapshot_alignment != 0 || offset < sizeof(snapshot_header) || offset > file_size
+                || num_particles > (file_size - offset) / (components * scalar_size))
+            {
+                throw std::runtime_error(std::string("Snapshot section ") + name
+                                         + " is misaligned or exceeds the file size");
+            }
+        };
+        check_section("x", offset_x, 3);
+        check_section("v", offset_v, 3);
+        check_section("mass", offset_mass, 1);
+        if (flags & snapshot_has_potential)
+        {
+            check_section("potential", offset_potential, 1);
+        }
+    }
+
+    static uint64_t align(uint64_t pos)
+    {
+        return (pos + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+    }
+};
+
+inline snapshot_header read_snapshot_header(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    snapshot_header h;
+    if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)))
+    {
+        throw std::runtime_error("Failed to read snapshot header from " + filename);
+    }
+    return h;
+}
+
+// Read-only view of a snapshot file. Memory-mapped where available. The header must be validated with
+// header.check(..., size()) before the sections are accessed.
+class mapped_snapshot
+{
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#if SNAPSHOT_WITH_MMAP
+    void* map = MAP_FAILED;
+#else
+    std::vector<char> contents;
+#endif
+
+public:
+    snapshot_header header;
+
+    explicit mapped_snapshot(const std::string& filename)
+    {
+#if SNAPSHOT_WITH_MMAP
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Failed to open " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            throw std::runtime_error("Failed to stat " + filename);
+        }
+        size_ = st.st_size;
+        map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map " + filename);
+        }
+        madvise(map, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(map);
+#else
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in)
+        {
+            throw std::runtime_error("Failed to open " + filename);
+        }
+        contents.resize(in.tellg());
+        in.seekg(0);
+        in.read(contents.data(), contents.size());
+        data_ = contents.data();
+        size_ = contents.size();
+#endif
+        if (size_ < sizeof(snapshot_header))
+        {
+            throw std::runtime_error("Snapshot file " + filename + " is truncated");
+        }
+        std::memcpy(&header, data_, sizeof(header));
+    }
+
+    mapped_snapshot(const mapped_snapshot&) = delete;
+    mapped_snapshot& operator=(const mapped_snapshot&) = delete;
+
+    ~mapped_snapshot()
+    {
+#if SNAPSHOT_WITH_MMAP
+        if (map != MAP_FAILED)
+        {
+            munmap(map, size_);
+        }
+#endif
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    template<class T>
+    const T* get(uint64_t offset) const
+    {
+        return reinterpret_cast<const T*>(data_ + offset);
+    }
+};
+
+/*
+  Writes snapshots in a background thread.
+  The device data is copied asynchronously into host staging memory, which is reused between checkpoints. The
+  background thread waits for the copies and writes the file, so the step loop can continue meanwhile.
+  Only one write is in flight at a time. A new checkpoint waits for the previous one to finish.
+ */
+template<class T>
+class snapshot_writer
+{
+    std::unique_ptr<char[]> staging; // Not initialized, only the padding is zeroed.
+    uint64_t staging_size = 0;
+    std::future<void> pending;
+
+public:
+    template<class VEC>
+    void write(const std::string& filename,
+               uint64_t step,
+               double time,
+               const goopax::buffer<VEC>& x,
+               const goopax::buffer<VEC>& v,
+               const goopax::buffer<T>& mass,
+               const goopax::buffer<T>* potential)
+    {
+        static_assert(sizeof(VEC) == 3 * sizeof(T));
+        wait();
+
+        const snapshot_header h = snapshot_header::make<T>(x.size(), step, time, potential != nullptr);
+        if (staging_size != h.file_size())
+        {
+            staging_size = h.file_size();
+            staging.reset(new char[staging_size]);
+        }
+        char* const p = staging.get();
+        std::memcpy(p, &h, sizeof(h));
+
+        // The sections in file order. Only the padding before each one is zeroed.
+        std::vector<goopax::goopax_future<void>> copies;
+        uint64_t end = sizeof(h);
+        auto place = [&](uint64_t offset, uint64_t bytes) {
+            std::memset(p + end, 0, offset - end);
+            end = offset + bytes;
+            return p + offset;
+        };
+        const uint64_t n = x.size();
+        copies.push_back(x.copy_to_host_async(reinterpret_cast<VEC*>(place(h.offset_x, n * sizeof(VEC)))));
+        copies.push_back(v.copy_to_host_async(reinterpret_cast<VEC*>(place(h.offset_v, n * sizeof(VEC)))));
+        copies.push_back(mass.copy_to_host_async(reinterpret_cast<T*>(place(h.offset_mass, n * sizeof(T)))));
+        if (potential)
+        {
+            copies.push_back(
+                potential->copy_to_host_async(reinterpret_cast<T*>(place(h.offset_potential, n * sizeof(T)))));
+        }
+
+        pending = std::async(std::launch::async, [this, filename, copies = std::move(copies)]() mutable {
+            for (auto& c : copies)
+            {
+                c.wait();
+            }
+            // Writing to a temporary file first, so that a crash during the write never leaves a broken checkpoint.
+            const std::string tmpname = filename + ".tmp";
+            {
+                std::ofstream out(tmpname, std::ios::binary);
+                out.write(staging.get(), staging_size);
+                if (!out)
+                {
+                    throw std::runtime_error("Failed to write " + tmpname);
+                }
+            }
+            if (std::rename(tmpname.c_str(), filename.c_str()) != 0)
+            {
+                throw std::runtime_error("Failed to rename " + tmpname + " to " + filename);
+            }
+        });
+    }
+
+    void wait()
+    {
+        if (pending.valid())
+        {
+            pending.get();
+        }
+    }
+
+    ~snapshot_writer()
+    {
+        if (pending.valid())
+        {
+            pending.wait();
+        }
+    }
+};
@@ -0,0 +1,195 @@
+/*
+  The levels of the tree as regular grids.
+
+  The signature bits cycle through the dimensions, starting with x. At depth d, dimension k has (d + 2 - k) / 3 bits,
+  so the nodes of depth d are the cells of a regular grid. A cell is found by descending from the root along its bits.
+  The descent stops early at nodes without children, whose particle range then contains that of the cell.
+
+  The particles must be sorted into the tree, i.e. x and the tree must be those of the last tree build.
+ */
+template<class T>
+struct tree_grid
+{
+    using gpu_T = typename make_gpu<T>::type;
+
+    const Vector<Tdouble, 3> boxlen; // Half-length of the simulation box in each dimension
+
+    struct level
+    {
+        Vector<gpu_uint, 3> bits; // Number of signature bits in each dimension
+        Vector<gpu_T, 3> cellsize;
+    };
+
+    explicit tree_grid(Tdouble halflen)
+        : boxlen({ halflen * pow(2.0, 2.0 / 3), halflen * pow(2.0, 1.0 / 3), halflen })
+    {
+    }
+
+    // Cell widths at the given depth.
+    Vector<Tdouble, 3> cell_extent(Tuint depth) const
+    {
+        Vector<Tdouble, 3> ret;
+        for (Tuint k = 0; k < 3; ++k)
+        {
+            ret[k] = 2 * boxlen[k] / (1u << ((depth + 2 - k) / 3));
+        }
+        return ret;
+    }
+
+    // Smallest cell width at the given depth.
+    Tdouble cellsize(Tuint depth) const
+    {
+        const Vector<Tdouble, 3> e = cell_extent(depth);
+        return min(min(e[0], e[1]), e[2]);
+    }
+
+    // Deepest level up to max_depth whose cells are at least size wide.
+    Tuint depth_for(Tdouble size, Tuint max_depth) const
+    {
+        Tuint depth = 0;
+        while (depth < max_depth && cellsize(depth + 1) >= size)
+        {
+            ++depth;
+        }
+        return depth;
+    }
+
+    level make_level(gpu_uint depth) const
+    {
+        level L;
+        for (Tuint k = 0; k < 3; ++k)
+        {
+            L.bits[k] = (depth + 2 - k) / 3;
+            L.cellsize[k] = (gpu_T)(2 * boxlen[k]) / static_cast<gpu_T>(gpu_uint(1) << L.bits[k]);
+        }
+        return L;
+    }
+
+    static gpu_T min_cellsize(const level& L)
+    {
+        return min(min(L.cellsize[0], L.cellsize[1]), L.cellsize[2]);
+    }
+
+    // Cell that contains x. Positions outside the box are clamped.
+    Vector<gpu_int, 3> cell_of(const level& L, const Vector<gpu_T, 3>& x) const
+    {
+        Vector<gpu_int, 3> c;
+        for (Tuint k = 0; k < 3; ++k)
+        {
+            const gpu_int num_cells = gpu_int(gpu_uint(1) << L.bits[k]);
+            c[k] = clamp(gpu_int(floor((x[k] + (T)boxlen[k]) / L.cellsize[k])), 0, num_cells - 1);
+        }
+        return c;
+    }
+
+    // Signature bit of cell c at depth j, i.e. the child to take when descending from depth j.
+    static gpu_uint child_bit(const level& L, const Vector<gpu_int, 3>& c, gpu_uint j)
+    {
+        const gpu_uint k = j % 3;
+        const gpu_uint ck = gpu_uint(cond(k == 0, c[0], cond(k == 1, c[1], c[2])));
+        const gpu_uint bk = cond(k == 0, L.bits[0], cond(k == 1, L.bits[1], L.bits[2]));
+        return (ck >> (bk - 1 - j / 3)) & 1;
+    }
+
+    // Node of cell c at the given depth, or its deepest existing ancestor. reached is the depth of the node.
+    template<class node_t>
+    static gpu_uint find_node(const resource<node_t>& tree,
+                              gpu_uint root,
+                              gpu_uint depth,
+                              const level& L,
+                              const Vector<gpu_int, 3>& c,
+                              gpu_uint& reached)
+    {
+        gpu_uint node = root;
+        reached = 0;
+        gpu_for(0, depth, [&](gpu_uint j) {
+            const gpu_uint first_child = tree[node].first_child;
+            node = cond(first_child != 0, first_child + child_bit(L, c, j), node);
+            reached = cond(first_child != 0, j + 1, reached);
+        });
+        return node;
+    }
+
+    template<class node_t>
+    static gpu_uint
+    find_node(const resource<node_t>& tree, gpu_uint root, gpu_uint depth, const level& L, const Vector<gpu_int, 3>& c)
+    {
+        gpu_uint reached;
+        return find_node(tree, root, depth, L, c, reached);
+    }
+
+    // Distance of x from the cells with coordinate ck in dimension k.
+    gpu_T axis_distance(const level& L, const Vector<gpu_T, 3>& x, Tuint k, gpu_int ck) const
+    {
+        const gpu_T lo = static_cast<gpu_T>(ck) * L.cellsize[k] - (T)boxlen[k];
+        return max(max(lo - x[k], x[k] - (lo + L.cellsize[k])), gpu_T(0));
+    }
+
+    /*
+      Calls func(pbegin, pend) for the particle ranges of the 27 cells around x at the given depth.
+      Cells that are farther than sqrt(r2) away are skipped. r2 is re-read for every cell, so it may shrink during
+      the search. All particles within the smallest cell width of x are found.
+      If the descent stops at a leaf, several of the cells share its node. func is only called for the one of them that
+      is closest to x in each dimension, so every particle is passed at most once. That cell is as close as the node
+      itself, so with a shrinking r2, the node is only skipped if all its particles are out of range.
+     */
+    template<class node_t, class FUNC>
+    void for_each_neighbor_cell(const resource<node_t>& tree,
+                                gpu_uint root,
+                                gpu_uint depth,
+                                const Vector<gpu_T, 3>& x,
+                                const gpu_T& r2,
+                                FUNC func) const
+    {
+        const level L = make_level(depth);
+        const Vector<gpu_int, 3> cell = cell_of(L, x);
+        gpu_for(0, 27, [&](gpu_uint offset) {
+            const Vector<gpu_int, 3> o = {
+                gpu_int(offset % 3) - 1, gpu_int(offset / 3 % 3) - 1, gpu_int(offset / 9) - 1
+            };
+            const Vector<gpu_int, 3> c = cell + o;
+
+            // Distance to the cell. The margin covers rounding in the signatures.
+            gpu_bool use = true;
+            gpu_T dist2 = 0;
+            for (Tuint k = 0; k < 3; ++k)
+            {
+                use = use && c[k] >= 0 && c[k] < gpu_int(gpu_uint(1) << L.bits[k]);
+                const gpu_T d = axis_distance(L, x, k, c[k]);
+                dist2 += d * d;
+            }
+            use = use && (dist2 <= r2 * (T)1.01);
+
+            gpu_if(use)
+            {
+                gpu_uint reached;
+                const gpu_uint node = find_node(tree, root, depth, L, c, reached);
+
+                // The cells of the same node agree in their bits down to the depth reached. Among those, the closest
+                // one in each dimension is used, the lowest on ties. It is at most as far away as c.
+                gpu_bool closest = true;
+                for (Tuint k = 0; k < 3; ++k)
+                {
+                    const gpu_uint shift = L.bits[k] - (reached + 2 - k) / 3;
+                    gpu_T best = numeric_limits<T>::max();
+                    gpu_int best_o = 2;
+                    for (Tint ok = -1; ok <= 1; ++ok)
+                    {
+                        const gpu_int ck = cell[k] + ok;
+                        const gpu_bool same = ck >= 0 && ck < gpu_int(gpu_uint(1) << L.bits[k])
+                                              && (gpu_uint(ck) >> shift) == (gpu_uint(c[k]) >> shift);
+                        const gpu_T d = axis_distance(L, x, k, ck);
+                        const gpu_bool better = same && d < best;
+                        best = cond(better, d, best);
+                        best_o = cond(better, gpu_int(ok), best_o);
+                    }
+                    closest = closest && (best_o == o[k]);
+                }
+                gpu_if(closest)
+                {
+                    func(gpu_uint(tree[node].pbegin), gpu_uint(tree[node].pend));
+                }
+            }
+        });
+    }
+};
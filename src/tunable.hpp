@@ -0,0 +1,117 @@
+/*
+  Parameters that can be overridden at runtime, e.g. by the autotuner or from a configuration file.
+  A tunable behaves like a PARAMOPT. The command line value is used unless it was overridden with set().
+  A configuration file only sets the tunables that were not given on the command line.
+ */
+
+#include <map>
+#include <optional>
+#include <sstream>
+
+struct tunable_base
+{
+    const string name;
+
+    explicit tunable_base(const char* name0)
+        : name(name0)
+    {
+        registry()[name] = this;
+    }
+
+    virtual ~tunable_base() = default;
+
+    virtual string get_string() const = 0;
+    virtual void set_string(const string& value) = 0;
+
+    static map<string, tunable_base*>& registry()
+    {
+        static map<string, tunable_base*> ret;
+        return ret;
+    }
+
+    // Whether the parameter was given on the command line, as --name=value or --name. args must be the command
+    // line before init_params, which removes the options it parsed.
+    static bool on_command_line(const string& name, const vector<string>& args)
+    {
+        const string option = "--" + name;
+        for (const string& arg : args)
+        {
+            if (arg == option || arg.rfind(option + "=", 0) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Reads name=value lines. Empty lines and lines starting with '#' are ignored. Parameters that were given on
+    // the command line keep their command line values.
+    static void read_config(const string& filename, const vector<string>& args)
+    {
+        ifstream in(filename);
+        if (!in)
+        {
+            throw std::runtime_error("Failed to open " + filename);
+        }
+        string line;
+        while (getline(in, line))
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+            auto eq = line.find('=');
+            if (eq == string::npos)
+            {
+                throw std::runtime_error("Bad line in " + filename + ": " + line);
+            }
+            auto it = registry().find(line.substr(0, eq));
+            if (it == registry().end())
+            {
+                throw std::runtime_error("Unknown parameter in " + filename + ": " + line.substr(0, eq));
+            }
+            if (!on_command_line(it->first, args))
+            {
+                it->second->set_string(line.substr(eq + 1));
+            }
+        }
+    }
+};
+
+template<class T>
+struct tunable : public tunable_base
+{
+    PARAMOPT<T> param;
+    optional<T> value;
+
+    tunable(const char* name, T default_value)
+        : tunable_base(name)
+        , param(name, default_value)
+    {
+    }
+
+    T operator()() const
+    {
+        return value ? *value : param();
+    }
+
+    void set(T v)
+    {
+        value = v;
+    }
+
+    string get_string() const override
+    {
+        stringstream s;
+        s << (*this)();
+        return s.str();
+    }
+
+    void set_string(const string& s) override
+    {
+        stringstream ss(s);
+        T v;
+        ss >> v;
+        if (ss.fail())
+        {
+            throw std::runtime_error("Bad value for " + name + ": " + s);
+        }
+        value = v;
+    }
+};
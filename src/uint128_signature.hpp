@@ -0,0 +1,106 @@
+/*
+  128-bit particle signatures as two 64-bit words, for trees deeper than 64 levels.
+
+  Provides the operations that the tree build and the sorting algorithms use on signatures: shifts, bitwise and/or,
+  and comparisons. Shift amounts must be below 128.
+ */
+
+#include <type_traits>
+
+template<class U = Tuint64_t>
+struct uint128_signature
+{
+    using goopax_struct_type = U;
+    template<typename X>
+    using goopax_struct_changetype = uint128_signature<typename goopax_struct_changetype<U, X>::type>;
+    using shift_type = typename change_gpu_mode<unsigned int, U>::type;
+    using bool_type = typename change_gpu_mode<bool, U>::type;
+
+    U hi;
+    U lo;
+
+    uint128_signature()
+    {
+    }
+
+    template<class V, class = std::enable_if_t<std::is_convertible<V, U>::value>>
+    uint128_signature(const V& lo0)
+        : hi(0)
+        , lo(lo0)
+    {
+    }
+
+    uint128_signature(const U& hi0, const U& lo0)
+        : hi(hi0)
+        , lo(lo0)
+    {
+    }
+
+    // The shifts by 1 avoid shifting a 64-bit word by 64.
+    friend uint128_signature operator>>(const uint128_signature& a, shift_type n)
+    {
+        const shift_type m = n & 63;
+        return { cond(n < 64u, a.hi >> m, U(0)), cond(n < 64u, (a.lo >> m) | ((a.hi << 1) << (63 - m)), a.hi >> m) };
+    }
+    friend uint128_signature operator<<(const uint128_signature& a, shift_type n)
+    {
+        const shift_type m = n & 63;
+        return { cond(n < 64u, (a.hi << m) | ((a.lo >> 1) >> (63 - m)), a.lo << m), cond(n < 64u, a.lo << m, U(0)) };
+    }
+    friend uint128_signature operator&(const uint128_signature& a, const uint128_signature& b)
+    {
+        return { a.hi & b.hi, a.lo & b.lo };
+    }
+    friend uint128_signature operator|(const uint128_signature& a, const uint128_signature& b)
+    {
+        return { a.hi | b.hi, a.lo | b.lo };
+    }
+
+    uint128_signature& operator>>=(shift_type n)
+    {
+        return *this = *this >> n;
+    }
+    uint128_signature& operator<<=(shift_type n)
+    {
+        return *this = *this << n;
+    }
+    uint128_signature& operator&=(const uint128_signature& b)
+    {
+        return *this = *this & b;
+    }
+    uint128_signature& operator|=(const uint128_signature& b)
+    {
+        return *this = *this | b;
+    }
+
+    friend bool_type operator==(const uint128_signature& a, const uint128_signature& b)
+    {
+        return a.hi == b.hi && a.lo == b.lo;
+    }
+    friend bool_type operator!=(const uint128_signature& a, const uint128_signature& b)
+    {
+        return !(a == b);
+    }
+    friend bool_type operator<(const uint128_signature& a, const uint128_signature& b)
+    {
+        return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+    }
+    friend bool_type operator>(const uint128_signature& a, const uint128_signature& b)
+    {
+        return b < a;
+    }
+    friend bool_type operator<=(const uint128_signature& a, const uint128_signature& b)
+    {
+        return !(b < a);
+    }
+    friend bool_type operator>=(const uint128_signature& a, const uint128_signature& b)
+    {
+        return !(a < b);
+    }
+};
+
+// Lowest 32 bits, as used by the radix sort.
+inline gpu_uint low_bits(const uint128_signature<gpu_uint64>& key)
+{
+    return gpu_uint(key.lo);
+}